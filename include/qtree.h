@@ -3,13 +3,19 @@
 #define QTREE_H
 
 #include <X11/Xlib.h>
+#include <pthread.h>
+#include "threadpool.h"
 
 #define BODYMAX 4096
+#define QTREE_TASK_MAX 64 /* default tasks per tree in the threadpool */
+#define QTREE_DEPTH_MAX 32 /* deeper ranges stay leaves with many bodies */
 
 typedef struct point_t point_t;
 typedef struct rectangle_t rectangle_t;
 typedef struct body_t body_t;
 typedef struct qtree_t qtree_t;
+typedef struct qtree_ctx_t qtree_ctx_t;
+typedef struct qtree_future_t qtree_future_t;
 
 /* coordinates of point */
 struct point_t {
@@ -28,6 +34,7 @@ struct rectangle_t {
 struct body_t {
   point_t *pos; 
   double mass;
+  qtree_t *leaf; /* leaf which holds the body, in one live qtree at most */
 };
 
 /* quad tree */
@@ -39,6 +46,43 @@ struct qtree_t {
   rectangle_t *range;
   body_t *body[BODYMAX];
   int count; /* number of bodies in the range*/
+  qtree_ctx_t *ctx; /* context which builds the node or NULL */
+  qtree_t *parent; /* NULL for root */
+  int depth; /* 0 for root */
+  /* aggregates of the bodies in the range, see qtree_aggregate */
+  double mass;
+  point_t center; /* mass-weighted centroid */
+  double min_x;   /* bounding box of the bodies */
+  double min_y;
+  double max_x;
+  double max_y;
+  int dirty; /* 1 if aggregates wait for qtree_body_update_batch */
+  int ready;   /* 1 once count and childs are final */
+  int done;    /* 1 once the whole subtree is built */
+  int pending; /* childs and own construction not done yet */
+  int waiting; /* threads in qtree_wait_node or qtree_wait_subtree */
+};
+
+/* state owned by one tree, many contexts may share one threadpool */
+struct qtree_ctx_t {
+  threadpool_t *threadpool;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int leaf_count; /* bodies held by leaves */
+  int pending;   /* constructions not finished yet */
+  int task_count; /* tasks of this context in the threadpool */
+  int task_max;   /* above this, subtrees are constructed inline */
+  int node_count; /* nodes in use */
+  qtree_t *free_node; /* removed nodes kept for reuse, linked by ur */
+};
+
+/* qtree being created on the threadpool, see qtree_create_async */
+struct qtree_future_t {
+  qtree_ctx_t *ctx;
+  int count;
+  body_t *(*body)[BODYMAX];
+  qtree_t *root;
+  int state; /* 0 while the root is created, 1 if created, -1 if fails */
 };
 
 point_t *point_create(double x, double y);
@@ -55,6 +99,9 @@ int is_point_in_rectangle_lr(point_t *p, rectangle_t *r);
 body_t *body_create(double x, double y, double mass);
 void body_free(body_t **b);
 rectangle_t *body_range(int count, body_t *(*body)[BODYMAX]);
+rectangle_t *body_range_list(int count, body_t **body);
+qtree_ctx_t *qtree_ctx_create(threadpool_t *threadpool, int task_max);
+void qtree_ctx_free(qtree_ctx_t **ctx);
 qtree_t *qtree_add(double x, double y, double dx, double dy);
 void qtree_remove(qtree_t **qtree);
 int qtree_push_body(qtree_t *qtree, body_t *body);
@@ -63,10 +110,24 @@ int qtree_clean_body(qtree_t *qtree);
 int qtree_split(qtree_t *qtree);
 void qtree_pickbody(qtree_t *qtree, int count, body_t *(*body)[BODYMAX],
                     int rectangle);
-qtree_t *qtree_create(int count, body_t *(*body)[BODYMAX]);
+qtree_t *qtree_create(qtree_ctx_t *ctx, int count, body_t *(*body)[BODYMAX]);
 void *qtree_construct(void *root_count_body);
 void *qtree_destruct(void *root);
-void wait_qtree(int body_num);
+int wait_qtree(qtree_ctx_t *ctx);
+qtree_future_t *qtree_create_async(qtree_ctx_t *ctx, int count,
+                                   body_t *(*body)[BODYMAX]);
+qtree_t *qtree_future_root(qtree_future_t *f);
+qtree_t *qtree_future_get(qtree_future_t *f);
+void qtree_future_free(qtree_future_t **f);
+int qtree_wait_node(qtree_t *node);
+void qtree_wait_subtree(qtree_t *node);
+int qtree_query_range(qtree_t *root, rectangle_t *range,
+                      body_t *(*body)[BODYMAX]);
+void qtree_aggregate(qtree_t *root);
+int qtree_body_update(body_t *body, double x, double y, double mass);
+int qtree_body_update_batch(qtree_t *root, int count,
+                            body_t *(*body)[BODYMAX],
+                            double *x, double *y, double *mass);
 void qtree_traverse(qtree_t *root);
 void qtree_traverse_draw_range(qtree_t *root, Display *dpy, Window w, GC gc,
                                point_t *base, double ratio, double shift);
@@ -0,0 +1,45 @@
+#ifndef QTREE_COMPACT_H
+#define QTREE_COMPACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "qtree.h"
+
+typedef struct qtree_cnode_t qtree_cnode_t;
+typedef struct qtree_compact_t qtree_compact_t;
+
+/* node without explicit range, derived from the root range and the path */
+struct qtree_cnode_t {
+  uint32_t child; /* index of the first of 4 childs or 0 if leaf */
+  uint32_t count; /* number of bodies in the range */
+  uint32_t first; /* index of the first body of a leaf */
+};
+
+/*
+ * read only quad tree in one array, the 4 childs of a node are adjacent
+ * in the order ur, ul, ll, lr; bodies of a leaf are adjacent too
+ */
+struct qtree_compact_t {
+  double x;  /* vertex of the root range */
+  double y;
+  double dx;
+  double dy;
+  int bits; /* 16 or 32 bits per body coordinate */
+  uint32_t node_num;
+  uint32_t body_num;
+  qtree_cnode_t *node;
+  void *pos;     /* x, y offsets in the leaf range, uint16_t or uint32_t */
+  body_t **body; /* exact bodies, out of line */
+};
+
+qtree_compact_t *qtree_compact_create(qtree_t *root, int bits);
+qtree_compact_t *qtree_compact_build(uint32_t count, body_t **body, int bits);
+void qtree_compact_free(qtree_compact_t **ct);
+size_t qtree_compact_size(qtree_compact_t *ct);
+void qtree_compact_child_range(int i, double *x, double *y,
+                               double *dx, double *dy);
+void qtree_compact_body_pos(qtree_compact_t *ct, uint32_t i,
+                            double x, double y, double dx, double dy,
+                            point_t *p);
+void qtree_compact_traverse(qtree_compact_t *ct);
+#endif
@@ -0,0 +1,26 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "qtree.h"
+#include "threadpool.h"
+
+#define RASTER_TILE 64 /* edge of a square tile in pixels */
+
+typedef struct raster_t raster_t;
+
+/* offscreen framebuffer */
+struct raster_t {
+  int width;
+  int height;
+  unsigned char *pixel;  /* rgb, 3 bytes per pixel, row major */
+  unsigned int *density; /* number of bodies which fall in each pixel */
+};
+
+raster_t *raster_create(int width, int height);
+void raster_free(raster_t **r);
+void raster_clear(raster_t *r);
+int raster_draw_qtree(raster_t *r, qtree_t *root, point_t *base,
+                      double ratio, double shift,
+                      threadpool_t *threadpool, int task);
+int raster_write_ppm(raster_t *r, const char *fn);
+#endif
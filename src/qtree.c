@@ -1,5 +1,6 @@
 
 #include <float.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,10 +8,6 @@
 #include "threadpool.h"
 
 
-static int leaf_count = 0;
-extern pthread_mutex_t mutex;
-extern pthread_cond_t cond;
-
 /**
  * @brief argument for qtree_pickbody run by thread 
  */
@@ -21,11 +18,31 @@ struct qtree_construct_t {
   int rectangle;
   int count;
   body_t *(*body)[BODYMAX];
+  int queued; /* 1 if run by the threadpool */
 };
 
 static qtree_construct_t*
 qtree_construct_setup(qtree_t *root, int rectangle, 
                       int count, body_t *(*body)[BODYMAX]);
+static void qtree_schedule(qtree_ctx_t *ctx, qtree_t *node,
+                           qtree_construct_t *arg);
+static void qtree_construct_split(qtree_ctx_t *ctx, qtree_t *node);
+static void qtree_construct_done(qtree_ctx_t *ctx, int queued,
+                                 qtree_t *node, int split);
+static int qtree_subtree_done(qtree_t *node);
+static void *qtree_future_run(void *future);
+static int qtree_query_node(qtree_t *node, rectangle_t *range,
+                            body_t *(*body)[BODYMAX], int count, int wait);
+static int qtree_quadrant(point_t *p, qtree_t *qtree, int rectangle);
+static void qtree_leaf(qtree_t *qtree);
+static qtree_t *qtree_ctx_add(qtree_ctx_t *ctx, double x, double y,
+                              double dx, double dy);
+static void qtree_aggregate_node(qtree_t *node);
+static void qtree_aggregate_dirty(qtree_t *node);
+static int qtree_child_quadrant(qtree_t *node);
+static qtree_t *qtree_body_root(qtree_t *leaf, point_t *p);
+static int qtree_body_mark(qtree_t *root, body_t *body, double x, double y,
+                           double mass);
 
 static qtree_construct_t*
 qtree_construct_setup(qtree_t *root, int rectangle, 
@@ -40,9 +57,153 @@ qtree_construct_setup(qtree_t *root, int rectangle,
   arg->rectangle = rectangle;
   arg->count = count;
   arg->body = body;
+  arg->queued = 0;
   return arg;
 }
 
+/**
+ * @brief run the construction by the threadpool, or inline if the context
+ * has used up its share of the queue or the queue is full
+ *
+ * The construction must already be counted in ctx->pending.
+ */
+static void qtree_schedule(qtree_ctx_t *ctx, qtree_t *node,
+                           qtree_construct_t *arg) {
+  if (!arg) {
+    fprintf(stderr, "Error: fail to schedule construction.\n");
+    qtree_construct_done(ctx, 0, node, 0);
+    return;
+  }
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->threadpool && ctx->task_count < ctx->task_max) {
+    ctx->task_count++;
+    arg->queued = 1;
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+  if (arg->queued) {
+    if (!threadpool_add(ctx->threadpool, qtree_construct, (void *) arg)) {
+      return;
+    }
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->task_count--;
+    pthread_mutex_unlock(&ctx->mutex);
+    arg->queued = 0;
+  }
+  qtree_construct((void *) arg);
+}
+
+/**
+ * @brief publish the childs of a node before constructing them
+ *
+ * The construction of the node itself stays pending with its childs, so
+ * the node is done only after every call on its subtree is through with
+ * ctx and the context may be freed.
+ */
+static void qtree_construct_split(qtree_ctx_t *ctx, qtree_t *node) {
+  pthread_mutex_lock(&ctx->mutex);
+  node->pending = 5;
+  node->ready = 1;
+  ctx->pending += 4;
+  if (node->waiting) {
+    pthread_cond_broadcast(&ctx->cond);
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * @brief account for a finished construction and wake up waiters
+ *
+ * Broadcasts only if a node waited on becomes ready or done, or the
+ * whole construction is over, so most nodes finish without a wakeup.
+ * @param split 1 if the childs of the node are published by
+ *        qtree_construct_split or 0 if it will not split any more
+ */
+static void qtree_construct_done(qtree_ctx_t *ctx, int queued,
+                                 qtree_t *node, int split) {
+  int wake = 0;
+
+  pthread_mutex_lock(&ctx->mutex);
+  if (queued) {
+    ctx->task_count--;
+  }
+  if (!split) {
+    if (!node->ur) {
+      ctx->leaf_count += node->count;
+    }
+    wake = qtree_subtree_done(node);
+  } else if (--node->pending == 0) {
+    wake = qtree_subtree_done(node);
+  }
+  ctx->pending--;
+  if (wake || ctx->pending == 0) {
+    pthread_cond_broadcast(&ctx->cond);
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * @brief mark the subtree of the node complete, then each ancestor whose
+ * childs are all complete; ctx->mutex must be held
+ * @return 1 if any of those nodes is waited on or 0 if not
+ */
+static int qtree_subtree_done(qtree_t *node) {
+  int wake = 0;
+
+  node->ready = 1;
+  for (;;) {
+    node->done = 1;
+    wake |= (node->waiting > 0);
+    node = node->parent;
+    if (!node || --node->pending > 0) {
+      break;
+    }
+  }
+  return wake;
+}
+
+/**
+ * @brief take a node from the free list of the context or malloc one
+ * @return pointer or NULL if fails
+ */
+static qtree_t *qtree_ctx_add(qtree_ctx_t *ctx, double x, double y,
+                              double dx, double dy) {
+  qtree_t *q = NULL;
+
+  if (!ctx) {
+    return qtree_add(x, y, dx, dy);
+  }
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->free_node) {
+    q = ctx->free_node;
+    ctx->free_node = q->ur;
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+  if (q) {
+    q->ur = NULL;
+    q->parent = NULL;
+    q->depth = 0;
+    q->mass = 0;
+    q->dirty = 0;
+    q->ready = 0;
+    q->done = 0;
+    q->pending = 0;
+    q->waiting = 0;
+    q->range->vertex->x = x;
+    q->range->vertex->y = y;
+    q->range->dx = dx;
+    q->range->dy = dy;
+  } else {
+    q = qtree_add(x, y, dx, dy);
+    if (!q) {
+      return NULL;
+    }
+  }
+  q->ctx = ctx;
+  pthread_mutex_lock(&ctx->mutex);
+  ctx->node_count++;
+  pthread_mutex_unlock(&ctx->mutex);
+  return q;
+}
 
 /**
  * @return pointer or NULL if fails
@@ -181,6 +342,7 @@ body_t *body_create(double x, double y, double mass) {
   pos->y = y;
   b->pos = pos;
   b->mass = mass;
+  b->leaf = NULL;
   return b;
 b_err:
   point_free(&pos);
@@ -195,15 +357,26 @@ void body_free(body_t **b) {
 }
 
 rectangle_t *body_range(int count, body_t *(*body)[BODYMAX]) {
+  return body_range_list(count, *body);
+}
+
+/**
+ * @brief square range around bodies with a margin, as for the root
+ * @return pointer or NULL if fails
+ */
+rectangle_t *body_range_list(int count, body_t **body) {
   int i;
-  double max_x = DBL_MIN, max_y = DBL_MIN;
+  double max_x = -DBL_MAX, max_y = -DBL_MAX;
   double min_x = DBL_MAX, min_y = DBL_MAX;
   double x, y, dx, dy;
   rectangle_t *range;
 
+  if (count == 0) {
+    min_x = min_y = max_x = max_y = 0;
+  }
   for (i = 0; i < count; i++) {
-    x = (*body)[i]->pos->x;
-    y = (*body)[i]->pos->y;
+    x = body[i]->pos->x;
+    y = body[i]->pos->y;
     min_x = (x < min_x) ? x : min_x;
     min_y = (y < min_y) ? y : min_y;
     max_x = (max_x < x) ? x : max_x;
@@ -223,6 +396,50 @@ rectangle_t *body_range(int count, body_t *(*body)[BODYMAX]) {
   return range;
 }
 
+/**
+ * @param threadpool pool to run constructions or NULL to build inline
+ * @param task_max max tasks of this context in the threadpool at once or
+ *        0 for QTREE_TASK_MAX
+ * @return pointer or NULL if fails
+ */
+qtree_ctx_t *qtree_ctx_create(threadpool_t *threadpool, int task_max) {
+  qtree_ctx_t *ctx;
+
+  ctx = malloc(sizeof(qtree_ctx_t));
+  if (!ctx) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    return NULL;
+  }
+  ctx->threadpool = threadpool;
+  pthread_mutex_init(&ctx->mutex, NULL);
+  pthread_cond_init(&ctx->cond, NULL);
+  ctx->leaf_count = 0;
+  ctx->pending = 0;
+  ctx->task_count = 0;
+  ctx->task_max = (task_max > 0) ? task_max : QTREE_TASK_MAX;
+  ctx->node_count = 0;
+  ctx->free_node = NULL;
+  return ctx;
+}
+
+/**
+ * @brief free the context, its trees must be destroyed before
+ */
+void qtree_ctx_free(qtree_ctx_t **ctx) {
+  qtree_t *q;
+
+  while ((*ctx)->free_node) {
+    q = (*ctx)->free_node;
+    (*ctx)->free_node = q->ur;
+    rectangle_free(&q->range);
+    free(q);
+  }
+  pthread_mutex_destroy(&(*ctx)->mutex);
+  pthread_cond_destroy(&(*ctx)->cond);
+  free(*ctx);
+  *ctx = NULL;
+}
+
 /**
  * @return pointer or NULL if fails
  */
@@ -245,6 +462,21 @@ qtree_t *qtree_add(double x, double y, double dx, double dy) {
   q->lr = NULL;
   q->range = r;
   q->count = 0;
+  q->ctx = NULL;
+  q->parent = NULL;
+  q->depth = 0;
+  q->mass = 0;
+  q->center.x = x + dx / 2;
+  q->center.y = y + dy / 2;
+  q->min_x = DBL_MAX;
+  q->min_y = DBL_MAX;
+  q->max_x = -DBL_MAX;
+  q->max_y = -DBL_MAX;
+  q->dirty = 0;
+  q->ready = 0;
+  q->done = 0;
+  q->pending = 0;
+  q->waiting = 0;
 
   return q;
 q_err:
@@ -253,10 +485,26 @@ r_err:
   return NULL;  
 }
 
+/**
+ * @brief free the node or give it back to its context
+ */
 void qtree_remove(qtree_t **qtree) {
-  rectangle_free(&(*qtree)->range);
+  qtree_ctx_t *ctx = (*qtree)->ctx;
+
   qtree_clean_body(*qtree);
-  free(*qtree);
+  if (ctx) {
+    (*qtree)->ul = NULL;
+    (*qtree)->ll = NULL;
+    (*qtree)->lr = NULL;
+    pthread_mutex_lock(&ctx->mutex);
+    (*qtree)->ur = ctx->free_node;
+    ctx->free_node = *qtree;
+    ctx->node_count--;
+    pthread_mutex_unlock(&ctx->mutex);
+  } else {
+    rectangle_free(&(*qtree)->range);
+    free(*qtree);
+  }
   (*qtree) = NULL;
 }
 
@@ -298,7 +546,8 @@ int qtree_clean_body(qtree_t *qtree) {
 }
 
 /**
- * @brief add 4 childs
+ * @brief add 4 childs, or none if any of them fails
+ * @return 0 if success or -1 if fail
  */
 int qtree_split(qtree_t *qtree) {
   rectangle_t *r;
@@ -313,15 +562,74 @@ int qtree_split(qtree_t *qtree) {
   v = r->vertex;
   dx = r->dx / 2;
   dy = r->dy / 2;
-  qtree->ur = qtree_add(v->x + dx, v->y + dy, dx, dy);
-  qtree->ul = qtree_add(v->x, v->y + dy, dx, dy);
-  qtree->ll = qtree_add(v->x, v->y, dx, dy);
-  qtree->lr = qtree_add(v->x + dx, v->y, dx, dy);
+  qtree->ur = qtree_ctx_add(qtree->ctx, v->x + dx, v->y + dy, dx, dy);
+  qtree->ul = qtree_ctx_add(qtree->ctx, v->x, v->y + dy, dx, dy);
+  qtree->ll = qtree_ctx_add(qtree->ctx, v->x, v->y, dx, dy);
+  qtree->lr = qtree_ctx_add(qtree->ctx, v->x + dx, v->y, dx, dy);
   if (!qtree->ur || !qtree->ul || !qtree->ll || !qtree->lr) {
     fprintf(stderr, "Error: fail to split qtree.\n");
-    return -1;
+    goto child_err;
   }
+  qtree->ur->parent = qtree;
+  qtree->ul->parent = qtree;
+  qtree->ll->parent = qtree;
+  qtree->lr->parent = qtree;
+  qtree->ur->depth = qtree->depth + 1;
+  qtree->ul->depth = qtree->depth + 1;
+  qtree->ll->depth = qtree->depth + 1;
+  qtree->lr->depth = qtree->depth + 1;
   return 0;
+child_err:
+  /* the node stays a leaf without childs */
+  if (qtree->ur) {
+    qtree_remove(&qtree->ur);
+  }
+  if (qtree->ul) {
+    qtree_remove(&qtree->ul);
+  }
+  if (qtree->ll) {
+    qtree_remove(&qtree->ll);
+  }
+  if (qtree->lr) {
+    qtree_remove(&qtree->lr);
+  }
+  return -1;
+}
+
+/**
+ * @brief check which side of the center of the parent the point is on
+ *
+ * The center is the corner the child shares with its siblings, computed
+ * as in qtree_split, so every body of the parent goes to exactly one
+ * child even when the outer edges of the child are rounded.
+ * @return 1 if in or 0 if not in or -1 if error
+ */
+static int qtree_quadrant(point_t *p, qtree_t *qtree, int rectangle) {
+  rectangle_t *r = qtree->range;
+
+  if (rectangle == upperright) {
+    return r->vertex->x <= p->x && r->vertex->y <= p->y;
+  }
+  if (rectangle == upperleft) {
+    return p->x < r->vertex->x + r->dx && r->vertex->y <= p->y;
+  }
+  if (rectangle == lowerleft) {
+    return p->x < r->vertex->x + r->dx && p->y < r->vertex->y + r->dy;
+  }
+  if (rectangle == lowerright) {
+    return r->vertex->x <= p->x && p->y < r->vertex->y + r->dy;
+  }
+  return -1;
+}
+
+/**
+ * @brief link the bodies of a leaf back to it
+ */
+static void qtree_leaf(qtree_t *qtree) {
+  int i;
+  for (i = 0; i < qtree->count; i++) {
+    qtree->body[i]->leaf = qtree;
+  }
 }
 
 /**
@@ -333,33 +641,49 @@ void qtree_pickbody(qtree_t *qtree, int count, body_t *(*body)[BODYMAX],
   int i;
   /* pick up */
   for (i = 0; i < count; i++) {
-    if (is_point_in_rectangle((*body)[i]->pos, qtree->range, rectangle)) {
+    if (qtree_quadrant((*body)[i]->pos, qtree, rectangle) == 1) {
       qtree->body[qtree->count++] = (*body)[i];
     }
   }
 }
 
-qtree_t *qtree_create(int count, body_t *(*body)[BODYMAX]) {
+/**
+ * @brief create the root and start constructing the subtrees
+ *
+ * Constructions run on ctx->threadpool; use wait_qtree to wait for them.
+ * Leaves link the bodies back through body->leaf, so a body belongs to
+ * at most one live qtree; qtree_destroy clears the links.
+ * @return pointer or NULL if fails
+ */
+qtree_t *qtree_create(qtree_ctx_t *ctx, int count, body_t *(*body)[BODYMAX]) {
   rectangle_t *root_range;
   qtree_t *root;
   qtree_construct_t *arg_ur, *arg_ul, *arg_ll, *arg_lr;
-  extern threadpool_t *threadpool;
   int i;
 
+  if (!ctx) {
+    fprintf(stderr, "Error: context is NULL.\n");
+    goto root_range_err;
+  }
   root_range = body_range(count, body);
   if (!root_range) {
     fprintf(stderr, "Error: fail to create root range.\n");
     goto root_range_err;
   }
 
-  root = qtree_add(root_range->vertex->x, root_range->vertex->y,
-                   root_range->dx, root_range->dy);
+  root = qtree_ctx_add(ctx, root_range->vertex->x, root_range->vertex->y,
+                       root_range->dx, root_range->dy);
   if (!root) {
     fprintf(stderr, "Error: fail to create root.\n");
     goto root_err;
   }
+  rectangle_free(&root_range);
 
   for (i = 0; i < count; i++) {
+    if (!isfinite((*body)[i]->pos->x) || !isfinite((*body)[i]->pos->y)) {
+      fprintf(stderr, "Error: body is not at a finite position.\n");
+      goto body_err;
+    }
     qtree_push_body(root, (*body)[i]);
   }
   
@@ -373,22 +697,16 @@ qtree_t *qtree_create(int count, body_t *(*body)[BODYMAX]) {
   printf("========================\n"); 
 */
 
-  /* only has 0 or 1 body */
-  if (root->count == 0) {
+  /* only has 0 or 1 body, or fails to add 4 childs */
+  if (root->count <= 1 || qtree_split(root)) {
+    qtree_leaf(root);
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->leaf_count += root->count;
+    qtree_subtree_done(root);
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
     return root;
   }
-  if (root->count == 1) {
-    pthread_mutex_lock(&mutex);
-    leaf_count++;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&mutex);
-    return root;
-  }
-  /* add 4 childs */
-  if (qtree_split(root)) {
-    fprintf(stderr, "Error: fail to split.\n");
-    goto split_err;
-  }
   /* set arguments for task run by thread */
   arg_ur = qtree_construct_setup(root->ur, upperright,
                                  root->count, &root->body);
@@ -398,16 +716,21 @@ qtree_t *qtree_create(int count, body_t *(*body)[BODYMAX]) {
                                  root->count, &root->body);
   arg_lr = qtree_construct_setup(root->lr, lowerright,
                                  root->count, &root->body);
-  /* add task to queue */
-  threadpool_add(threadpool, qtree_construct, (void *) arg_ur);
-  threadpool_add(threadpool, qtree_construct, (void *) arg_ul);
-  threadpool_add(threadpool, qtree_construct, (void *) arg_ll);
-  threadpool_add(threadpool, qtree_construct, (void *) arg_lr);
-
+  /* add task to queue, the root is counted as one construction too */
+  pthread_mutex_lock(&ctx->mutex);
+  ctx->pending++;
+  pthread_mutex_unlock(&ctx->mutex);
+  qtree_construct_split(ctx, root);
+  qtree_schedule(ctx, root->ur, arg_ur);
+  qtree_schedule(ctx, root->ul, arg_ul);
+  qtree_schedule(ctx, root->ll, arg_ll);
+  qtree_schedule(ctx, root->lr, arg_lr);
+  qtree_construct_done(ctx, 0, root, 1);
   return root;
 
-split_err:
+body_err:
   qtree_remove(&root);
+  return NULL;
 root_err:
   rectangle_free(&root_range); 
 root_range_err:
@@ -421,8 +744,11 @@ void *qtree_construct(void *root_count_body) {
   int rectangle = arg->rectangle;
   int count = arg->count;
   body_t *(*body)[BODYMAX] = arg->body;
+  int queued = arg->queued;
+  qtree_ctx_t *ctx = root->ctx;
   qtree_construct_t *arg_ur, *arg_ul, *arg_ll, *arg_lr;
-  extern threadpool_t *threadpool;
+
+  free(arg);
   /* pick body */
   qtree_pickbody(root, count, body, rectangle);
  
@@ -436,23 +762,24 @@ void *qtree_construct(void *root_count_body) {
   printf("========================\n"); 
 */
 
-  /* only has 0 or 1 child */
+  /* only has 0 or 1 child, or bodies too close to split */
   if (root->count == 0) {
+    qtree_construct_done(ctx, queued, root, 0);
     return NULL;
   }
-  if (root->count == 1) {
-    pthread_mutex_lock(&mutex);
-    leaf_count++;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&mutex);
+  if (root->count == 1 || root->depth >= QTREE_DEPTH_MAX) {
+    qtree_leaf(root);
+    qtree_construct_done(ctx, queued, root, 0);
+    return NULL;
+  }
+  /* construct 4 childs, or keep all bodies here if that fails */
+  if (qtree_split(root)) {
+    fprintf(stderr, "Error: fail to split.\n");
+    qtree_leaf(root);
+    qtree_construct_done(ctx, queued, root, 0);
     return NULL;
   }
-  /* construct 4 childs */
-  pthread_mutex_lock(&mutex);
-  qtree_split(root);
-  pthread_mutex_unlock(&mutex);
   /* set arguments for task run by thread */
-  pthread_mutex_lock(&mutex);
   arg_ur = qtree_construct_setup(root->ur, upperright, 
                                  root->count, &root->body);
   arg_ul = qtree_construct_setup(root->ul, upperleft, 
@@ -461,35 +788,43 @@ void *qtree_construct(void *root_count_body) {
                                  root->count, &root->body);
   arg_lr = qtree_construct_setup(root->lr, lowerright, 
                                  root->count, &root->body);
-  pthread_mutex_unlock(&mutex);
   /* add task to queue */
-  threadpool_add(threadpool, qtree_construct, (void *) arg_ur);
-  threadpool_add(threadpool, qtree_construct, (void *) arg_ul);
-  threadpool_add(threadpool, qtree_construct, (void *) arg_ll);
-  threadpool_add(threadpool, qtree_construct, (void *) arg_lr);
+  qtree_construct_split(ctx, root);
+  qtree_schedule(ctx, root->ur, arg_ur);
+  qtree_schedule(ctx, root->ul, arg_ul);
+  qtree_schedule(ctx, root->ll, arg_ll);
+  qtree_schedule(ctx, root->lr, arg_lr);
+  qtree_construct_done(ctx, queued, root, 1);
+  return NULL;
 }
 
 void *qtree_destruct(void *root) {
   qtree_t **r = (qtree_t **) root;
   qtree_t *ur, *ul, *ll, *lr;
-  extern threadpool_t *threadpool;
+  qtree_ctx_t *ctx;
+  int i;
 
   if (!(*r)) {
     return NULL;
   }
 
   if ((*r)->count == 0) {
-    pthread_mutex_lock(&mutex);
     qtree_remove(r);
-    pthread_mutex_unlock(&mutex);
     return NULL;
   }
-  if ((*r)->count == 1) {
-    pthread_mutex_lock(&mutex);
-    leaf_count--;
-    pthread_cond_signal(&cond);
+  if (!(*r)->ur) {
+    for (i = 0; i < (*r)->count; i++) {
+      if ((*r)->body[i]->leaf == *r) {
+        (*r)->body[i]->leaf = NULL;
+      }
+    }
+    ctx = (*r)->ctx;
+    if (ctx) {
+      pthread_mutex_lock(&ctx->mutex);
+      ctx->leaf_count -= (*r)->count;
+      pthread_mutex_unlock(&ctx->mutex);
+    }
     qtree_remove(r);
-    pthread_mutex_unlock(&mutex);
     return NULL;
   }
   ur = (*r)->ur;
@@ -497,35 +832,421 @@ void *qtree_destruct(void *root) {
   ll = (*r)->ll;
   lr = (*r)->lr;
 
-  pthread_mutex_lock(&mutex);
   qtree_remove(r);
-  pthread_mutex_unlock(&mutex);
 
   qtree_destruct((void *)&ur);
   qtree_destruct((void *)&ul);
   qtree_destruct((void *)&ll);
   qtree_destruct((void *)&lr);
-/*
-  threadpool_add(threadpool, qtree_destruct, (void *)&ur);
-  threadpool_add(threadpool, qtree_destruct, (void *)&ul);
-  threadpool_add(threadpool, qtree_destruct, (void *)&ll);
-  threadpool_add(threadpool, qtree_destruct, (void *)&lr);
-*/
+  return NULL;
 }
 
 /**
  * @brief wait for qtree to be done by all threads
+ * @return number of bodies held by leaves
  */
-void wait_qtree(int body_num) {
-  extern int leaf_count;
-  pthread_mutex_lock(&mutex);
-  while (leaf_count != body_num) {
+int wait_qtree(qtree_ctx_t *ctx) {
+  int leaf_count;
+
+  pthread_mutex_lock(&ctx->mutex);
+  while (ctx->pending != 0) {
     /*
-    printf("leaf count: %d\n", leaf_count);
+    printf("leaf count: %d\n", ctx->leaf_count);
     */
-    pthread_cond_wait(&cond, &mutex);
+    pthread_cond_wait(&ctx->cond, &ctx->mutex);
+  }
+  leaf_count = ctx->leaf_count;
+  pthread_mutex_unlock(&ctx->mutex);
+  return leaf_count;
+}
+
+static void *qtree_future_run(void *future) {
+  qtree_future_t *f = (qtree_future_t *) future;
+  qtree_ctx_t *ctx = f->ctx;
+  qtree_t *root;
+
+  root = qtree_create(ctx, f->count, f->body);
+  pthread_mutex_lock(&ctx->mutex);
+  f->root = root;
+  f->state = root ? 1 : -1;
+  ctx->pending--;
+  pthread_cond_broadcast(&ctx->cond);
+  pthread_mutex_unlock(&ctx->mutex);
+  return NULL;
+}
+
+/**
+ * @brief create the qtree on the threadpool and return at once
+ *
+ * Queries may start on the root from qtree_future_root while subtrees
+ * are still constructed; they wait only on the nodes they visit.
+ * @return pointer or NULL if fails
+ */
+qtree_future_t *qtree_create_async(qtree_ctx_t *ctx, int count,
+                                   body_t *(*body)[BODYMAX]) {
+  qtree_future_t *f;
+
+  if (!ctx) {
+    fprintf(stderr, "Error: context is NULL.\n");
+    return NULL;
+  }
+  f = malloc(sizeof(qtree_future_t));
+  if (!f) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    return NULL;
   }
-  pthread_mutex_unlock(&mutex);
+  f->ctx = ctx;
+  f->count = count;
+  f->body = body;
+  f->root = NULL;
+  f->state = 0;
+  pthread_mutex_lock(&ctx->mutex);
+  ctx->pending++;
+  pthread_mutex_unlock(&ctx->mutex);
+  if (!ctx->threadpool ||
+      threadpool_add(ctx->threadpool, qtree_future_run, (void *) f)) {
+    qtree_future_run((void *) f);
+  }
+  return f;
+}
+
+/**
+ * @brief wait for the root only, not for its subtrees
+ * @return root or NULL if the qtree fails to be created
+ */
+qtree_t *qtree_future_root(qtree_future_t *f) {
+  qtree_t *root;
+
+  pthread_mutex_lock(&f->ctx->mutex);
+  while (f->state == 0) {
+    pthread_cond_wait(&f->ctx->cond, &f->ctx->mutex);
+  }
+  root = f->root;
+  pthread_mutex_unlock(&f->ctx->mutex);
+  return root;
+}
+
+/**
+ * @brief wait for the whole qtree
+ * @return root or NULL if the qtree fails to be created
+ */
+qtree_t *qtree_future_get(qtree_future_t *f) {
+  qtree_t *root = qtree_future_root(f);
+
+  if (root) {
+    qtree_wait_subtree(root);
+  }
+  return root;
+}
+
+/**
+ * @brief free the future, the qtree stays and is freed by qtree_destroy
+ * after qtree_future_get
+ */
+void qtree_future_free(qtree_future_t **f) {
+  qtree_future_root(*f);
+  free(*f);
+  *f = NULL;
+}
+
+/**
+ * @brief wait until count and childs of the node are final
+ * @return 1 if the whole subtree is built or 0 if not yet
+ */
+int qtree_wait_node(qtree_t *node) {
+  qtree_ctx_t *ctx = node->ctx;
+  int done;
+
+  if (!ctx) {
+    return 1;
+  }
+  pthread_mutex_lock(&ctx->mutex);
+  while (!node->ready) {
+    node->waiting++;
+    pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    node->waiting--;
+  }
+  done = node->done;
+  pthread_mutex_unlock(&ctx->mutex);
+  return done;
+}
+
+/**
+ * @brief wait until the whole subtree of the node is built
+ */
+void qtree_wait_subtree(qtree_t *node) {
+  qtree_ctx_t *ctx = node->ctx;
+
+  if (!ctx) {
+    return;
+  }
+  pthread_mutex_lock(&ctx->mutex);
+  while (!node->done) {
+    node->waiting++;
+    pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    node->waiting--;
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * @param wait 0 if the subtree is known to be built
+ */
+static int qtree_query_node(qtree_t *node, rectangle_t *range,
+                            body_t *(*body)[BODYMAX], int count, int wait) {
+  rectangle_t *r;
+  int i;
+
+  /* the range is final once the parent is ready, count and childs are
+   * not, so only nodes which overlap are waited on */
+  r = node->range;
+  if (r->vertex->x + r->dx < range->vertex->x ||
+      range->vertex->x + range->dx < r->vertex->x ||
+      r->vertex->y + r->dy < range->vertex->y ||
+      range->vertex->y + range->dy < r->vertex->y) {
+    return count;
+  }
+  if (wait) {
+    wait = !qtree_wait_node(node);
+  }
+  if (node->count == 0) {
+    return count;
+  }
+  if (!node->ur) {
+    for (i = 0; i < node->count && count < BODYMAX; i++) {
+      if (is_point_in_rectangle_ur(node->body[i]->pos, range)) {
+        (*body)[count++] = node->body[i];
+      }
+    }
+    return count;
+  }
+  count = qtree_query_node(node->ur, range, body, count, wait);
+  count = qtree_query_node(node->ul, range, body, count, wait);
+  count = qtree_query_node(node->ll, range, body, count, wait);
+  count = qtree_query_node(node->lr, range, body, count, wait);
+  return count;
+}
+
+/**
+ * @brief collect bodies in the range, which may be still constructed
+ *
+ * Only the nodes visited are waited on, so a query on a finished part
+ * returns while the rest of the qtree is built.
+ * @return number of bodies found
+ */
+int qtree_query_range(qtree_t *root, rectangle_t *range,
+                      body_t *(*body)[BODYMAX]) {
+  if (!root) {
+    return 0;
+  }
+  return qtree_query_node(root, range, body, 0, 1);
+}
+
+/**
+ * @brief recompute aggregates of one node from its childs or bodies
+ */
+static void qtree_aggregate_node(qtree_t *node) {
+  qtree_t *childs[4];
+  qtree_t *c;
+  body_t *b;
+  double mx = 0, my = 0;
+  int i;
+
+  node->mass = 0;
+  node->min_x = DBL_MAX;
+  node->min_y = DBL_MAX;
+  node->max_x = -DBL_MAX;
+  node->max_y = -DBL_MAX;
+  if (node->ur) {
+    childs[0] = node->ur;
+    childs[1] = node->ul;
+    childs[2] = node->ll;
+    childs[3] = node->lr;
+    for (i = 0; i < 4; i++) {
+      c = childs[i];
+      if (c->count == 0) {
+        continue;
+      }
+      node->mass += c->mass;
+      mx += c->center.x * c->mass;
+      my += c->center.y * c->mass;
+      node->min_x = (c->min_x < node->min_x) ? c->min_x : node->min_x;
+      node->min_y = (c->min_y < node->min_y) ? c->min_y : node->min_y;
+      node->max_x = (node->max_x < c->max_x) ? c->max_x : node->max_x;
+      node->max_y = (node->max_y < c->max_y) ? c->max_y : node->max_y;
+    }
+  } else {
+    for (i = 0; i < node->count; i++) {
+      b = node->body[i];
+      node->mass += b->mass;
+      mx += b->pos->x * b->mass;
+      my += b->pos->y * b->mass;
+      node->min_x = (b->pos->x < node->min_x) ? b->pos->x : node->min_x;
+      node->min_y = (b->pos->y < node->min_y) ? b->pos->y : node->min_y;
+      node->max_x = (node->max_x < b->pos->x) ? b->pos->x : node->max_x;
+      node->max_y = (node->max_y < b->pos->y) ? b->pos->y : node->max_y;
+    }
+  }
+  if (node->mass != 0) {
+    node->center.x = mx / node->mass;
+    node->center.y = my / node->mass;
+  } else {
+    node->center.x = node->range->vertex->x + node->range->dx / 2;
+    node->center.y = node->range->vertex->y + node->range->dy / 2;
+  }
+  node->dirty = 0;
+}
+
+/**
+ * @brief recompute dirty nodes only, each one once after its childs
+ */
+static void qtree_aggregate_dirty(qtree_t *node) {
+  if (!node || !node->dirty) {
+    return;
+  }
+  qtree_aggregate_dirty(node->ur);
+  qtree_aggregate_dirty(node->ul);
+  qtree_aggregate_dirty(node->ll);
+  qtree_aggregate_dirty(node->lr);
+  qtree_aggregate_node(node);
+}
+
+/**
+ * @return upperright, upperleft, lowerleft or lowerright as which child
+ * of its parent the node is, or 0 for root
+ */
+static int qtree_child_quadrant(qtree_t *node) {
+  qtree_t *parent = node->parent;
+
+  if (!parent) {
+    return 0;
+  }
+  if (parent->ur == node) {
+    return upperright;
+  }
+  if (parent->ul == node) {
+    return upperleft;
+  }
+  if (parent->ll == node) {
+    return lowerleft;
+  }
+  return lowerright;
+}
+
+/**
+ * @brief check the point against every center on the path up from the
+ * leaf, as qtree_pickbody does, so it would be built into the same leaf
+ * @return root of the leaf or NULL if the point leaves the leaf
+ */
+static qtree_t *qtree_body_root(qtree_t *leaf, point_t *p) {
+  qtree_t *node;
+
+  for (node = leaf; node->parent; node = node->parent) {
+    if (qtree_quadrant(p, node, qtree_child_quadrant(node)) != 1) {
+      return NULL;
+    }
+  }
+  if (!is_point_in_rectangle_ur(p, node->range)) {
+    return NULL;
+  }
+  return node;
+}
+
+/**
+ * @brief change the body and mark the path from its leaf to the root
+ *
+ * Marking stops at the first dirty node, so paths of a batch are merged.
+ * @return 0 if success or -1 if the body leaves its leaf or is not in
+ * root, when root is not NULL
+ */
+static int qtree_body_mark(qtree_t *root, body_t *body, double x, double y,
+                           double mass) {
+  qtree_t *node = body->leaf;
+  qtree_t *body_root;
+  point_t p;
+
+  if (!node) {
+    fprintf(stderr, "Error: body is not in a qtree.\n");
+    return -1;
+  }
+  p.x = x;
+  p.y = y;
+  body_root = qtree_body_root(node, &p);
+  if (!body_root) {
+    fprintf(stderr, "Error: body moves out of its leaf.\n");
+    return -1;
+  }
+  if (root && body_root != root) {
+    fprintf(stderr, "Error: body is in another qtree.\n");
+    return -1;
+  }
+  body->pos->x = x;
+  body->pos->y = y;
+  body->mass = mass;
+  for (; node && !node->dirty; node = node->parent) {
+    node->dirty = 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief compute count, mass, centroid and bounding box of every node
+ *
+ * Run after wait_qtree; keep them up to date with qtree_body_update.
+ */
+void qtree_aggregate(qtree_t *root) {
+  if (!root) {
+    return;
+  }
+  qtree_aggregate(root->ur);
+  qtree_aggregate(root->ul);
+  qtree_aggregate(root->ll);
+  qtree_aggregate(root->lr);
+  qtree_aggregate_node(root);
+}
+
+/**
+ * @brief move a body inside its leaf or change its mass, and update the
+ * aggregates on the path to the root in O(depth)
+ *
+ * Not thread safe with other updates of the same qtree.
+ * @return 0 if success or -1 if the body leaves its leaf
+ */
+int qtree_body_update(body_t *body, double x, double y, double mass) {
+  qtree_t *node;
+
+  if (qtree_body_mark(NULL, body, x, y, mass)) {
+    return -1;
+  }
+  for (node = body->leaf; node; node = node->parent) {
+    qtree_aggregate_node(node);
+  }
+  return 0;
+}
+
+/**
+ * @brief update many bodies of the qtree, each ancestor is recomputed
+ * once however many of its bodies change
+ *
+ * Bodies of other qtrees are left unchanged and count as failures.
+ * @return number of bodies which fail to update
+ */
+int qtree_body_update_batch(qtree_t *root, int count,
+                            body_t *(*body)[BODYMAX],
+                            double *x, double *y, double *mass) {
+  int i, fail = 0;
+
+  if (!root) {
+    fprintf(stderr, "Error: qtree is NULL.\n");
+    return count;
+  }
+  for (i = 0; i < count; i++) {
+    if (qtree_body_mark(root, (*body)[i], x[i], y[i], mass[i])) {
+      fail++;
+    }
+  }
+  qtree_aggregate_dirty(root);
+  return fail;
 }
 
 void qtree_traverse(qtree_t *root) {
@@ -538,6 +1259,8 @@ void qtree_traverse(qtree_t *root) {
                                        root->range->dx,
                                        root->range->dy);
   printf("count=%d\n", root->count);
+  printf("mass=%lf center=(%lf, %lf)\n", root->mass, root->center.x,
+                                         root->center.y);
   printf("========================\n"); 
   qtree_traverse(root->ur);
   qtree_traverse(root->ul);
@@ -556,6 +1279,7 @@ void qtree_traverse_draw_range(qtree_t *root, Display *dpy, Window w, GC gc,
   y = p->y;
   dx = root->range->dx * ratio;
   dy = root->range->dy * ratio;
+  point_free(&p);
   XDrawRectangle(dpy, w, gc, x, y, dx, dy);
   qtree_traverse_draw_range(root->ur, dpy, w, gc, base, ratio, shift);
   qtree_traverse_draw_range(root->ul, dpy, w, gc, base, ratio, shift);
@@ -563,42 +1287,15 @@ void qtree_traverse_draw_range(qtree_t *root, Display *dpy, Window w, GC gc,
   qtree_traverse_draw_range(root->lr, dpy, w, gc, base, ratio, shift);
 }
 
+/**
+ * @brief free the whole qtree, wait_qtree must have returned before
+ *
+ * Bodies stay and are unlinked from their leaves.
+ */
 void qtree_destroy(qtree_t **root) {
-  extern threadpool_t *threadpool;
-  qtree_t *ur, *ul, *ll, *lr;
-
   if (!(*root)) {
     fprintf(stderr, "Error: qtree has been destroyed.\n");
     return ;
   }
-
-  if ((*root)->count == 0) {
-    qtree_remove(root);
-    return ;
-  }
-  if ((*root)->count == 1) {
-    pthread_mutex_lock(&mutex);
-    leaf_count--;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&mutex);
-    qtree_remove(root);
-    return ;
-  }
- 
-  ur = (*root)->ur;
-  ul = (*root)->ul;
-  ll = (*root)->ll;
-  lr = (*root)->lr;
-
-  qtree_remove(root);
-  qtree_destruct((void *)&ur);
-  qtree_destruct((void *)&ul);
-  qtree_destruct((void *)&ll);
-  qtree_destruct((void *)&lr);
-/*
-  threadpool_add(threadpool, qtree_destruct, (void *)&ur);
-  threadpool_add(threadpool, qtree_destruct, (void *)&ul);
-  threadpool_add(threadpool, qtree_destruct, (void *)&ll);
-  threadpool_add(threadpool, qtree_destruct, (void *)&lr);
-*/
+  qtree_destruct((void *) root);
 }
@@ -0,0 +1,429 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "qtree.h"
+#include "qtree_compact.h"
+
+/**
+ * @brief node of the source qtree waiting in the breadth first queue
+ */
+typedef struct qtree_compact_item_t qtree_compact_item_t;
+struct qtree_compact_item_t {
+  qtree_t *q;
+  double x;
+  double y;
+  double dx;
+  double dy;
+};
+
+static uint32_t qtree_compact_count(qtree_t *root);
+static uint32_t qtree_compact_quantize(double v, double base, double d,
+                                       int bits);
+static void qtree_compact_store(qtree_compact_t *ct, uint32_t b,
+                                double x, double y, double dx, double dy);
+static uint32_t qtree_compact_partition(body_t **body, uint32_t count,
+                                        int (*in)(body_t *, double, double),
+                                        double mx, double my);
+static int qtree_compact_is_upper(body_t *b, double mx, double my);
+static int qtree_compact_is_right(body_t *b, double mx, double my);
+static int qtree_compact_is_left(body_t *b, double mx, double my);
+static int qtree_compact_build_node(qtree_compact_t *ct, uint32_t *node_max,
+                                    uint32_t i, uint32_t first,
+                                    uint32_t count, double x, double y,
+                                    double dx, double dy, int depth);
+static void qtree_compact_traverse_node(qtree_compact_t *ct, uint32_t i,
+                                        double x, double y,
+                                        double dx, double dy);
+
+/**
+ * @return number of nodes in the qtree
+ */
+static uint32_t qtree_compact_count(qtree_t *root) {
+  if (!root) {
+    return 0;
+  }
+  return 1 + qtree_compact_count(root->ur) + qtree_compact_count(root->ul) +
+         qtree_compact_count(root->ll) + qtree_compact_count(root->lr);
+}
+
+/**
+ * @brief map v in [base, base + d] to [0, 2^bits - 1]
+ */
+static uint32_t qtree_compact_quantize(double v, double base, double d,
+                                       int bits) {
+  double max = (bits == 16) ? UINT16_MAX : UINT32_MAX;
+  double t = (d > 0) ? (v - base) / d : 0;
+
+  t = (t < 0) ? 0 : ((t > 1) ? 1 : t);
+  return (uint32_t) lround(t * max);
+}
+
+/**
+ * @brief quantize the b-th body relative to the leaf range
+ */
+static void qtree_compact_store(qtree_compact_t *ct, uint32_t b,
+                                double x, double y, double dx, double dy) {
+  point_t *p = ct->body[b]->pos;
+
+  if (ct->bits == 16) {
+    ((uint16_t *) ct->pos)[2 * b] =
+        (uint16_t) qtree_compact_quantize(p->x, x, dx, 16);
+    ((uint16_t *) ct->pos)[2 * b + 1] =
+        (uint16_t) qtree_compact_quantize(p->y, y, dy, 16);
+  } else {
+    ((uint32_t *) ct->pos)[2 * b] = qtree_compact_quantize(p->x, x, dx, 32);
+    ((uint32_t *) ct->pos)[2 * b + 1] =
+        qtree_compact_quantize(p->y, y, dy, 32);
+  }
+}
+
+/**
+ * @brief convert a finished qtree into the compact format
+ *
+ * Bodies are kept by pointer for exact positions, the qtree can be
+ * destroyed afterwards but not the bodies.
+ * @param bits 16 or 32 bits per body coordinate
+ * @return pointer or NULL if fails
+ */
+qtree_compact_t *qtree_compact_create(qtree_t *root, int bits) {
+  qtree_compact_t *ct;
+  qtree_compact_item_t *queue, *item;
+  qtree_cnode_t *n;
+  qtree_t *childs[4];
+  uint32_t head, tail, b;
+  int i;
+
+  if (!root) {
+    fprintf(stderr, "Error: qtree is NULL.\n");
+    goto ct_err;
+  }
+  if (bits != 16 && bits != 32) {
+    fprintf(stderr, "Error: only 16 or 32 bits are supported.\n");
+    goto ct_err;
+  }
+  ct = malloc(sizeof(qtree_compact_t));
+  if (!ct) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    goto ct_err;
+  }
+  ct->x = root->range->vertex->x;
+  ct->y = root->range->vertex->y;
+  ct->dx = root->range->dx;
+  ct->dy = root->range->dy;
+  ct->bits = bits;
+  ct->node_num = qtree_compact_count(root);
+  ct->body_num = root->count;
+  ct->node = malloc(sizeof(qtree_cnode_t) * ct->node_num);
+  ct->pos = malloc((size_t) bits / 8 * 2 * ct->body_num + 1);
+  ct->body = malloc(sizeof(body_t *) * ct->body_num + 1);
+  queue = malloc(sizeof(qtree_compact_item_t) * ct->node_num);
+  if (!ct->node || !ct->pos || !ct->body || !queue) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    goto array_err;
+  }
+
+  /* breadth first, so the 4 childs of a node are adjacent */
+  queue[0].q = root;
+  queue[0].x = ct->x;
+  queue[0].y = ct->y;
+  queue[0].dx = ct->dx;
+  queue[0].dy = ct->dy;
+  head = 0;
+  tail = 1;
+  b = 0;
+  while (head < tail) {
+    item = &queue[head];
+    n = &ct->node[head];
+    head++;
+    n->count = item->q->count;
+    n->child = 0;
+    n->first = b;
+    if (item->q->ur) {
+      n->child = tail;
+      childs[0] = item->q->ur;
+      childs[1] = item->q->ul;
+      childs[2] = item->q->ll;
+      childs[3] = item->q->lr;
+      for (i = 0; i < 4; i++) {
+        queue[tail].q = childs[i];
+        queue[tail].x = item->x;
+        queue[tail].y = item->y;
+        queue[tail].dx = item->dx;
+        queue[tail].dy = item->dy;
+        qtree_compact_child_range(i, &queue[tail].x, &queue[tail].y,
+                                  &queue[tail].dx, &queue[tail].dy);
+        tail++;
+      }
+      continue;
+    }
+    /* leaf: bodies relative to its range */
+    for (i = 0; i < item->q->count && b < ct->body_num; i++, b++) {
+      ct->body[b] = item->q->body[i];
+      qtree_compact_store(ct, b, item->x, item->y, item->dx, item->dy);
+    }
+  }
+  ct->body_num = b;
+  free(queue);
+  return ct;
+
+array_err:
+  free(queue);
+  free(ct->node);
+  free(ct->pos);
+  free(ct->body);
+  free(ct);
+ct_err:
+  return NULL;
+}
+
+/**
+ * @brief move bodies for which in() holds to the front
+ * @return number of such bodies
+ */
+static uint32_t qtree_compact_partition(body_t **body, uint32_t count,
+                                        int (*in)(body_t *, double, double),
+                                        double mx, double my) {
+  body_t *tmp;
+  uint32_t i, n = 0;
+
+  for (i = 0; i < count; i++) {
+    if (in(body[i], mx, my)) {
+      tmp = body[n];
+      body[n++] = body[i];
+      body[i] = tmp;
+    }
+  }
+  return n;
+}
+
+/* sides of the center, as in qtree_quadrant */
+static int qtree_compact_is_upper(body_t *b, double mx, double my) {
+  return my <= b->pos->y;
+}
+
+static int qtree_compact_is_right(body_t *b, double mx, double my) {
+  return mx <= b->pos->x;
+}
+
+static int qtree_compact_is_left(body_t *b, double mx, double my) {
+  return b->pos->x < mx;
+}
+
+/**
+ * @brief build node i over ct->body[first, first + count) and its subtree
+ * @return 0 if success or -1 if fail
+ */
+static int qtree_compact_build_node(qtree_compact_t *ct, uint32_t *node_max,
+                                    uint32_t i, uint32_t first,
+                                    uint32_t count, double x, double y,
+                                    double dx, double dy, int depth) {
+  qtree_cnode_t *node;
+  body_t **body = &ct->body[first];
+  uint32_t child, part[4], start, k;
+  double hdx = dx / 2, hdy = dy / 2;
+  double mx = x + hdx, my = y + hdy;
+  double cx, cy, cdx, cdy;
+
+  ct->node[i].count = count;
+  ct->node[i].first = first;
+  ct->node[i].child = 0;
+  if (count <= 1 || depth >= QTREE_DEPTH_MAX) {
+    for (k = 0; k < count; k++) {
+      qtree_compact_store(ct, first + k, x, y, dx, dy);
+    }
+    return 0;
+  }
+  /* ur, ul | ll, lr */
+  start = qtree_compact_partition(body, count, qtree_compact_is_upper,
+                                  mx, my);
+  part[0] = qtree_compact_partition(body, start, qtree_compact_is_right,
+                                    mx, my);
+  part[1] = start - part[0];
+  part[2] = qtree_compact_partition(body + start, count - start,
+                                    qtree_compact_is_left, mx, my);
+  part[3] = count - start - part[2];
+
+  if (ct->node_num + 4 > *node_max) {
+    node = realloc(ct->node, sizeof(qtree_cnode_t) * *node_max * 2);
+    if (!node) {
+      fprintf(stderr, "Error: fail to realloc.\n");
+      return -1;
+    }
+    ct->node = node;
+    *node_max *= 2;
+  }
+  child = ct->node_num;
+  ct->node_num += 4;
+  ct->node[i].child = child;
+  for (k = 0, start = first; k < 4; start += part[k], k++) {
+    cx = x;
+    cy = y;
+    cdx = dx;
+    cdy = dy;
+    qtree_compact_child_range(k, &cx, &cy, &cdx, &cdy);
+    if (qtree_compact_build_node(ct, node_max, child + k, start, part[k],
+                                 cx, cy, cdx, cdy, depth + 1)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief build the compact format straight from bodies, without qtree_t
+ * nodes and without the BODYMAX limit
+ *
+ * Ranges and the leaf of each body match qtree_create. The 4 childs of
+ * a node are adjacent, but nodes are laid out depth first.
+ * @param bits 16 or 32 bits per body coordinate
+ * @return pointer or NULL if fails
+ */
+qtree_compact_t *qtree_compact_build(uint32_t count, body_t **body, int bits) {
+  qtree_compact_t *ct;
+  rectangle_t *range;
+  uint32_t i, node_max;
+
+  if (bits != 16 && bits != 32) {
+    fprintf(stderr, "Error: only 16 or 32 bits are supported.\n");
+    goto ct_err;
+  }
+  for (i = 0; i < count; i++) {
+    if (!isfinite(body[i]->pos->x) || !isfinite(body[i]->pos->y)) {
+      fprintf(stderr, "Error: body is not at a finite position.\n");
+      goto ct_err;
+    }
+  }
+  range = body_range_list((int) count, body);
+  if (!range) {
+    fprintf(stderr, "Error: fail to create root range.\n");
+    goto ct_err;
+  }
+  ct = calloc(1, sizeof(qtree_compact_t));
+  if (!ct) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    rectangle_free(&range);
+    goto ct_err;
+  }
+  ct->x = range->vertex->x;
+  ct->y = range->vertex->y;
+  ct->dx = range->dx;
+  ct->dy = range->dy;
+  rectangle_free(&range);
+  ct->bits = bits;
+  ct->node_num = 1;
+  ct->body_num = count;
+  node_max = 64;
+  ct->node = malloc(sizeof(qtree_cnode_t) * node_max);
+  ct->pos = malloc((size_t) bits / 8 * 2 * count + 1);
+  ct->body = malloc(sizeof(body_t *) * count + 1);
+  if (!ct->node || !ct->pos || !ct->body) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    goto build_err;
+  }
+  for (i = 0; i < count; i++) {
+    ct->body[i] = body[i];
+  }
+  if (qtree_compact_build_node(ct, &node_max, 0, 0, count,
+                               ct->x, ct->y, ct->dx, ct->dy, 0)) {
+    goto build_err;
+  }
+  return ct;
+
+build_err:
+  qtree_compact_free(&ct);
+ct_err:
+  return NULL;
+}
+
+void qtree_compact_free(qtree_compact_t **ct) {
+  free((*ct)->node);
+  free((*ct)->pos);
+  free((*ct)->body);
+  free(*ct);
+  *ct = NULL;
+}
+
+/**
+ * @return bytes held by the compact qtree, bodies excluded
+ */
+size_t qtree_compact_size(qtree_compact_t *ct) {
+  return sizeof(qtree_compact_t) + sizeof(qtree_cnode_t) * ct->node_num +
+         ((size_t) ct->bits / 8 * 2 + sizeof(body_t *)) * ct->body_num;
+}
+
+/**
+ * @brief turn the range of a node into the range of its i-th child,
+ * 0 to 3 for ur, ul, ll, lr as in qtree_split
+ */
+void qtree_compact_child_range(int i, double *x, double *y,
+                               double *dx, double *dy) {
+  *dx = *dx / 2;
+  *dy = *dy / 2;
+  if (i == 0 || i == 3) {
+    *x = *x + *dx;
+  }
+  if (i == 0 || i == 1) {
+    *y = *y + *dy;
+  }
+}
+
+/**
+ * @brief approximate position of the i-th body in the leaf range
+ * (x, y, dx, dy), the exact one is ct->body[i]->pos
+ */
+void qtree_compact_body_pos(qtree_compact_t *ct, uint32_t i,
+                            double x, double y, double dx, double dy,
+                            point_t *p) {
+  double qx, qy, max;
+
+  if (ct->bits == 16) {
+    qx = ((uint16_t *) ct->pos)[2 * i];
+    qy = ((uint16_t *) ct->pos)[2 * i + 1];
+    max = UINT16_MAX;
+  } else {
+    qx = ((uint32_t *) ct->pos)[2 * i];
+    qy = ((uint32_t *) ct->pos)[2 * i + 1];
+    max = UINT32_MAX;
+  }
+  p->x = x + qx / max * dx;
+  p->y = y + qy / max * dy;
+}
+
+static void qtree_compact_traverse_node(qtree_compact_t *ct, uint32_t i,
+                                        double x, double y,
+                                        double dx, double dy) {
+  qtree_cnode_t *n = &ct->node[i];
+  double cx, cy, cdx, cdy;
+  point_t p;
+  uint32_t j;
+  int k;
+
+  printf("========================\n");
+  printf("(%lf, %lf) dx=%lf dy=%lf\n", x, y, dx, dy);
+  printf("count=%u\n", n->count);
+  if (!n->child) {
+    for (j = n->first; j < n->first + n->count && j < ct->body_num; j++) {
+      qtree_compact_body_pos(ct, j, x, y, dx, dy, &p);
+      printf("body (%lf, %lf)\n", p.x, p.y);
+    }
+  }
+  printf("========================\n");
+  if (!n->child) {
+    return;
+  }
+  for (k = 0; k < 4; k++) {
+    cx = x;
+    cy = y;
+    cdx = dx;
+    cdy = dy;
+    qtree_compact_child_range(k, &cx, &cy, &cdx, &cdy);
+    qtree_compact_traverse_node(ct, n->child + k, cx, cy, cdx, cdy);
+  }
+}
+
+void qtree_compact_traverse(qtree_compact_t *ct) {
+  if (!ct || ct->node_num == 0) {
+    return;
+  }
+  qtree_compact_traverse_node(ct, 0, ct->x, ct->y, ct->dx, ct->dy);
+}
@@ -0,0 +1,383 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qtree.h"
+#include "raster.h"
+#include "threadpool.h"
+
+#define RANGE_COLOR 0x60
+
+/**
+ * @brief argument for raster_tile_run run by the caller and threadpool tasks
+ *
+ * The caller and every posted task hold a reference, the last one frees
+ * the job, so a task which starts after the frame is done just leaves.
+ */
+typedef struct raster_job_t raster_job_t;
+struct raster_job_t {
+  raster_t *r;
+  qtree_t *root;
+  point_t *base;
+  double ratio;
+  double shift;
+  int tile_x; /* number of tiles in a row */
+  int tile_num;
+  int next; /* next tile to render */
+  int active; /* tiles being rendered */
+  int ref; /* caller and tasks not finished yet */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/**
+ * @brief pixel bounds of one tile, [x0, x1) x [y0, y1)
+ */
+typedef struct raster_tile_t raster_tile_t;
+struct raster_tile_t {
+  raster_job_t *job;
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+};
+
+static void raster_tile_plot(raster_tile_t *t, double x, double y,
+                             unsigned int count);
+static void raster_tile_range(raster_tile_t *t, double x, double y,
+                              double dx, double dy);
+static void raster_tile_qtree(raster_tile_t *t, qtree_t *node);
+static void raster_tile_shade(raster_tile_t *t);
+static void *raster_tile_run(void *job);
+static void *raster_tile_task(void *job);
+static raster_job_t *raster_job_create(raster_t *r, qtree_t *root,
+                                       point_t *base, double ratio,
+                                       double shift);
+static void raster_job_release(raster_job_t *job);
+
+/**
+ * @brief add bodies to the density of the pixel covering (x, y)
+ */
+static void raster_tile_plot(raster_tile_t *t, double x, double y,
+                             unsigned int count) {
+  int ix = (int) floor(x);
+  int iy = (int) floor(y);
+  if (ix < t->x0 || t->x1 <= ix || iy < t->y0 || t->y1 <= iy) {
+    return;
+  }
+  t->job->r->density[iy * t->job->r->width + ix] += count;
+}
+
+/**
+ * @brief draw the outline of a range, clipped to the tile
+ */
+static void raster_tile_range(raster_tile_t *t, double x, double y,
+                              double dx, double dy) {
+  raster_t *r = t->job->r;
+  int ix0 = (int) floor(x), iy0 = (int) floor(y);
+  int ix1 = (int) floor(x + dx), iy1 = (int) floor(y + dy);
+  int lo, hi, i;
+
+  /* horizontal edges */
+  lo = (ix0 < t->x0) ? t->x0 : ix0;
+  hi = (t->x1 - 1 < ix1) ? t->x1 - 1 : ix1;
+  for (i = lo; i <= hi; i++) {
+    if (t->y0 <= iy0 && iy0 < t->y1) {
+      memset(&r->pixel[3 * (iy0 * r->width + i)], RANGE_COLOR, 3);
+    }
+    if (t->y0 <= iy1 && iy1 < t->y1) {
+      memset(&r->pixel[3 * (iy1 * r->width + i)], RANGE_COLOR, 3);
+    }
+  }
+  /* vertical edges */
+  lo = (iy0 < t->y0) ? t->y0 : iy0;
+  hi = (t->y1 - 1 < iy1) ? t->y1 - 1 : iy1;
+  for (i = lo; i <= hi; i++) {
+    if (t->x0 <= ix0 && ix0 < t->x1) {
+      memset(&r->pixel[3 * (i * r->width + ix0)], RANGE_COLOR, 3);
+    }
+    if (t->x0 <= ix1 && ix1 < t->x1) {
+      memset(&r->pixel[3 * (i * r->width + ix1)], RANGE_COLOR, 3);
+    }
+  }
+}
+
+/**
+ * @brief render the part of the qtree which overlaps the tile
+ *
+ * A range smaller than one pixel is not refined any further: its bodies
+ * are added to the density of a single pixel, so the cost is bounded by
+ * the size of the tile rather than the size of the tree.
+ */
+static void raster_tile_qtree(raster_tile_t *t, qtree_t *node) {
+  raster_job_t *job = t->job;
+  double x, y, dx, dy;
+  int i;
+
+  if (!node) {
+    return;
+  }
+  x = job->shift + (node->range->vertex->x - job->base->x) * job->ratio;
+  y = job->shift + (node->range->vertex->y - job->base->y) * job->ratio;
+  dx = node->range->dx * job->ratio;
+  dy = node->range->dy * job->ratio;
+  /* cull ranges outside the tile */
+  if (x + dx < t->x0 || t->x1 <= x || y + dy < t->y0 || t->y1 <= y) {
+    return;
+  }
+  /* level of detail: sub-pixel range */
+  if (dx < 1 && dy < 1) {
+    if (node->count > 0) {
+      raster_tile_plot(t, x + dx / 2, y + dy / 2, node->count);
+    }
+    return;
+  }
+  raster_tile_range(t, x, y, dx, dy);
+  if (!node->ur) {
+    for (i = 0; i < node->count; i++) {
+      raster_tile_plot(t,
+                       job->shift + (node->body[i]->pos->x - job->base->x) *
+                       job->ratio,
+                       job->shift + (node->body[i]->pos->y - job->base->y) *
+                       job->ratio,
+                       1);
+    }
+    return;
+  }
+  raster_tile_qtree(t, node->ur);
+  raster_tile_qtree(t, node->ul);
+  raster_tile_qtree(t, node->ll);
+  raster_tile_qtree(t, node->lr);
+}
+
+/**
+ * @brief map the body density of the tile to brightness
+ */
+static void raster_tile_shade(raster_tile_t *t) {
+  raster_t *r = t->job->r;
+  unsigned int d;
+  int x, y, c;
+
+  for (y = t->y0; y < t->y1; y++) {
+    for (x = t->x0; x < t->x1; x++) {
+      d = r->density[y * r->width + x];
+      if (d == 0) {
+        continue;
+      }
+      c = 128 + (int) (32 * log2((double) d));
+      c = (c > 255) ? 255 : c;
+      memset(&r->pixel[3 * (y * r->width + x)], c, 3);
+    }
+  }
+}
+
+/**
+ * @brief render tiles until none is left
+ *
+ * Only j->lock and the tile counters are touched once no tile is left,
+ * the raster and the qtree may be gone by then.
+ */
+static void *raster_tile_run(void *job) {
+  raster_job_t *j = (raster_job_t *) job;
+  raster_tile_t t;
+  int i;
+
+  t.job = j;
+  for (;;) {
+    pthread_mutex_lock(&j->lock);
+    i = j->next++;
+    if (i < j->tile_num) {
+      j->active++;
+    }
+    pthread_mutex_unlock(&j->lock);
+    if (i >= j->tile_num) {
+      break;
+    }
+    t.x0 = (i % j->tile_x) * RASTER_TILE;
+    t.y0 = (i / j->tile_x) * RASTER_TILE;
+    t.x1 = (t.x0 + RASTER_TILE < j->r->width) ?
+           t.x0 + RASTER_TILE : j->r->width;
+    t.y1 = (t.y0 + RASTER_TILE < j->r->height) ?
+           t.y0 + RASTER_TILE : j->r->height;
+    raster_tile_qtree(&t, j->root);
+    raster_tile_shade(&t);
+    pthread_mutex_lock(&j->lock);
+    j->active--;
+    if (j->active == 0 && j->next >= j->tile_num) {
+      pthread_cond_signal(&j->cond);
+    }
+    pthread_mutex_unlock(&j->lock);
+  }
+  return NULL;
+}
+
+/**
+ * @brief raster_tile_run as a threadpool task
+ */
+static void *raster_tile_task(void *job) {
+  raster_tile_run(job);
+  raster_job_release((raster_job_t *) job);
+  return NULL;
+}
+
+/**
+ * @return job held by the caller or NULL if fails
+ */
+static raster_job_t *raster_job_create(raster_t *r, qtree_t *root,
+                                       point_t *base, double ratio,
+                                       double shift) {
+  raster_job_t *job;
+
+  job = malloc(sizeof(raster_job_t));
+  if (!job) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    return NULL;
+  }
+  job->r = r;
+  job->root = root;
+  job->base = base;
+  job->ratio = ratio;
+  job->shift = shift;
+  job->tile_x = (r->width + RASTER_TILE - 1) / RASTER_TILE;
+  job->tile_num = job->tile_x *
+                  ((r->height + RASTER_TILE - 1) / RASTER_TILE);
+  job->next = 0;
+  job->active = 0;
+  job->ref = 1;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  return job;
+}
+
+/**
+ * @brief drop one reference, the last one frees the job
+ */
+static void raster_job_release(raster_job_t *job) {
+  int ref;
+
+  pthread_mutex_lock(&job->lock);
+  ref = --job->ref;
+  pthread_mutex_unlock(&job->lock);
+  if (ref == 0) {
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+  }
+}
+
+/**
+ * @return pointer or NULL if fails
+ */
+raster_t *raster_create(int width, int height) {
+  raster_t *r;
+
+  if (width <= 0 || height <= 0) {
+    fprintf(stderr, "Error: invalid raster size.\n");
+    goto r_err;
+  }
+  r = malloc(sizeof(raster_t));
+  if (!r) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    goto r_err;
+  }
+  r->width = width;
+  r->height = height;
+  r->pixel = malloc(3 * (size_t) width * height);
+  if (!r->pixel) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    goto pixel_err;
+  }
+  r->density = malloc(sizeof(unsigned int) * (size_t) width * height);
+  if (!r->density) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    goto density_err;
+  }
+  raster_clear(r);
+  return r;
+density_err:
+  free(r->pixel);
+pixel_err:
+  free(r);
+r_err:
+  return NULL;
+}
+
+void raster_free(raster_t **r) {
+  free((*r)->pixel);
+  free((*r)->density);
+  free(*r);
+  *r = NULL;
+}
+
+void raster_clear(raster_t *r) {
+  memset(r->pixel, 0, 3 * (size_t) r->width * r->height);
+  memset(r->density, 0, sizeof(unsigned int) * (size_t) r->width * r->height);
+}
+
+/**
+ * @brief draw ranges and body density of the qtree into the raster
+ *
+ * The raster is cut into tiles of RASTER_TILE pixels. The caller and up to
+ * `task` tasks on the threadpool take tiles until none is left; without a
+ * threadpool the caller renders them all. Coordinates are mapped as in
+ * point_in_window.
+ *
+ * Returns once every tile is rendered. Tasks still queued then find no
+ * tile and exit, so a busy threadpool, or a call from one of its own
+ * tasks, only costs the caller the tiles it renders itself.
+ * @return 0 if success or -1 if fail
+ */
+int raster_draw_qtree(raster_t *r, qtree_t *root, point_t *base,
+                      double ratio, double shift,
+                      threadpool_t *threadpool, int task) {
+  raster_job_t *job;
+  int i;
+
+  job = raster_job_create(r, root, base, ratio, shift);
+  if (!job) {
+    return -1;
+  }
+  for (i = 0; threadpool && i < task; i++) {
+    pthread_mutex_lock(&job->lock);
+    job->ref++;
+    pthread_mutex_unlock(&job->lock);
+    if (threadpool_add(threadpool, raster_tile_task, (void *) job)) {
+      raster_job_release(job);
+      break;
+    }
+  }
+  /* tiles left by tasks which are late or fail to be added are done here */
+  raster_tile_run((void *) job);
+  /* wait only for tiles which tasks have started */
+  pthread_mutex_lock(&job->lock);
+  while (job->active != 0) {
+    pthread_cond_wait(&job->cond, &job->lock);
+  }
+  pthread_mutex_unlock(&job->lock);
+  raster_job_release(job);
+  return 0;
+}
+
+/**
+ * @brief write the raster as a binary PPM image
+ * @return 0 if success or -1 if fail
+ */
+int raster_write_ppm(raster_t *r, const char *fn) {
+  FILE *fd;
+  size_t size = 3 * (size_t) r->width * r->height;
+
+  fd = fopen(fn, "wb");
+  if (!fd) {
+    fprintf(stderr, "Error: fail to open file.\n");
+    return -1;
+  }
+  fprintf(fd, "P6\n%d %d\n255\n", r->width, r->height);
+  if (fwrite(r->pixel, 1, size, fd) != size) {
+    fprintf(stderr, "Error: fail to write image.\n");
+    fclose(fd);
+    return -1;
+  }
+  fclose(fd);
+  return 0;
+}
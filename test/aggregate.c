@@ -0,0 +1,267 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qtree.h"
+#include "test_util.h"
+#include "threadpool.h"
+
+#define THREAD 4
+#define QUEUE 4096
+#define FIELD 7 /* doubles saved per node */
+
+int save_aggregate(qtree_t *node, double *buf);
+int check_aggregate(qtree_t *root, int node_count);
+void move_in_leaf(body_t *b, double *x, double *y);
+int check_same(int count, body_t *(*body)[BODYMAX], double *x, double *y,
+               double *mass);
+
+/**
+ * @brief aggregates kept by qtree_body_update and qtree_body_update_batch
+ * equal a full qtree_aggregate, bodies of another qtree and moves out of
+ * the leaf are rejected, and destroyed qtrees unlink their bodies
+ */
+int main(int argc, char *argv[]) {
+  int round = (argc > 1) ? atoi(argv[1]) : 100;
+  int count = (argc > 2) ? atoi(argv[2]) : 1000;
+  static body_t *body[BODYMAX];
+  static body_t *other[BODYMAX];
+  static body_t *batch[BODYMAX];
+  static double x[BODYMAX], y[BODYMAX], mass[BODYMAX];
+  threadpool_t *threadpool;
+  qtree_ctx_t *ctx, *ctx_other;
+  qtree_t *root, *root_other;
+  body_t *edge[4];
+  int r, i, k, n, fail = 0;
+
+  if (count < 2 || count > BODYMAX / 2) {
+    fprintf(stderr, "Error: count must be in [2, %d].\n", BODYMAX / 2);
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < count; i++) {
+    /* every 8th body shares a position, so leaves hold several bodies */
+    if (i % 8 == 0) {
+      body[i] = body_create(321.5, 654.25, 1 + i % 5);
+    } else {
+      body[i] = body_create(rand() % 100000 / 10.0, rand() % 100000 / 10.0,
+                            1 + i % 5);
+    }
+    other[i] = body_create(rand() % 1000, rand() % 1000, 1);
+  }
+  threadpool = threadpool_create(THREAD, QUEUE);
+  ctx = qtree_ctx_create(threadpool, 0);
+  ctx_other = qtree_ctx_create(threadpool, 0);
+  root = qtree_create(ctx, count, &body);
+  root_other = qtree_create(ctx_other, count, &other);
+  wait_qtree(ctx);
+  wait_qtree(ctx_other);
+  qtree_aggregate(root);
+  qtree_aggregate(root_other);
+
+  /* single updates */
+  for (r = 0; r < round; r++) {
+    i = rand() % count;
+    move_in_leaf(body[i], &x[0], &y[0]);
+    if (qtree_body_update(body[i], x[0], y[0], rand() % 10 + 1)) {
+      fprintf(stderr, "Error: single update is rejected.\n");
+      fail++;
+    }
+  }
+  if (check_aggregate(root, ctx->node_count)) {
+    fprintf(stderr, "Error: single updates break the aggregates.\n");
+    fail++;
+  }
+
+  /* batches, bodies at one position share their whole path */
+  for (r = 0; r < round; r++) {
+    n = 1 + rand() % count;
+    for (k = 0; k < n; k++) {
+      i = (k % 2) ? rand() % count : (rand() % count) / 8 * 8;
+      batch[k] = body[i];
+      move_in_leaf(batch[k], &x[k], &y[k]);
+      mass[k] = rand() % 10 + 1;
+    }
+    /* a body may come twice, the last update wins */
+    k = 0;
+    while (k < n) {
+      for (i = k + 1; i < n && batch[i] != batch[k]; i++) {
+      }
+      if (i < n) {
+        memmove(&batch[k], &batch[k + 1], sizeof(batch[0]) * (n - k - 1));
+        memmove(&x[k], &x[k + 1], sizeof(x[0]) * (n - k - 1));
+        memmove(&y[k], &y[k + 1], sizeof(y[0]) * (n - k - 1));
+        memmove(&mass[k], &mass[k + 1], sizeof(mass[0]) * (n - k - 1));
+        n--;
+      } else {
+        k++;
+      }
+    }
+    if (qtree_body_update_batch(root, n, &batch, x, y, mass) != 0 ||
+        check_same(n, &batch, x, y, mass)) {
+      fprintf(stderr, "Error: batch update is rejected.\n");
+      fail++;
+    }
+    if (check_aggregate(root, ctx->node_count)) {
+      fprintf(stderr, "Error: batch breaks the aggregates, round %d.\n", r);
+      fail++;
+    }
+  }
+
+  /* a batch which mixes two qtrees only changes the given one */
+  for (k = 0; k < 20; k++) {
+    batch[k] = (k % 2) ? other[k] : body[k];
+    move_in_leaf(batch[k], &x[k], &y[k]);
+    mass[k] = 2;
+  }
+  for (k = 1; k < 20; k += 2) {
+    x[k] = other[k]->pos->x;
+    y[k] = other[k]->pos->y;
+    mass[k] = other[k]->mass;
+    other[k]->mass += 1;
+  }
+  if (qtree_body_update_batch(root, 20, &batch, x, y, mass) != 10) {
+    fprintf(stderr, "Error: bodies of another qtree are updated.\n");
+    fail++;
+  }
+  for (k = 1; k < 20; k += 2) {
+    other[k]->mass -= 1;
+  }
+  if (check_same(20, &batch, x, y, mass) ||
+      check_aggregate(root, ctx->node_count) ||
+      check_aggregate(root_other, ctx_other->node_count)) {
+    fprintf(stderr, "Error: batch over two qtrees breaks them.\n");
+    fail++;
+  }
+
+  /* the root is (-5, -5) to (15, 15), moves onto the center (5, 5) or
+   * out of the root are rejected */
+  qtree_destroy(&root_other);
+  wait_qtree(ctx_other);
+  edge[0] = body_create(0, 0, 1);
+  edge[1] = body_create(10, 0, 1);
+  edge[2] = body_create(0, 10, 1);
+  edge[3] = body_create(10, 10, 1);
+  root_other = qtree_create(ctx_other, 4, (body_t *(*)[BODYMAX]) &edge);
+  wait_qtree(ctx_other);
+  qtree_aggregate(root_other);
+  if (qtree_body_update(edge[0], 5, 5, 1) != -1 ||
+      qtree_body_update(edge[0], 4.5, 5, 1) != -1 ||
+      qtree_body_update(edge[0], -6, 0, 1) != -1 ||
+      qtree_body_update(edge[3], 10, 15.5, 1) != -1 ||
+      edge[0]->pos->x != 0 || edge[0]->pos->y != 0 ||
+      qtree_body_update(edge[0], 4.5, 4.5, 1) != 0 ||
+      qtree_body_update(edge[3], 5, 5, 1) != 0 ||
+      qtree_body_update(edge[2], 0, 5, 1) != 0 ||
+      check_aggregate(root_other, ctx_other->node_count)) {
+    fprintf(stderr, "Error: edges between leaves differ from the build.\n");
+    fail++;
+  }
+
+  /* destroyed qtrees leave no dangling leaf behind */
+  qtree_destroy(&root_other);
+  qtree_destroy(&root);
+  wait_qtree(ctx);
+  wait_qtree(ctx_other);
+  for (i = 0; i < 4; i++) {
+    if (edge[i]->leaf || qtree_body_update(edge[i], 1, 1, 1) != -1) {
+      fprintf(stderr, "Error: body keeps its leaf after destroy.\n");
+      fail++;
+    }
+    body_free(&edge[i]);
+  }
+  for (i = 0; i < count; i++) {
+    if (body[i]->leaf || other[i]->leaf) {
+      fprintf(stderr, "Error: body keeps its leaf after destroy.\n");
+      fail++;
+      break;
+    }
+  }
+
+  qtree_ctx_free(&ctx);
+  qtree_ctx_free(&ctx_other);
+  threadpool_destroy(threadpool);
+  for (i = 0; i < count; i++) {
+    body_free(&body[i]);
+    body_free(&other[i]);
+  }
+  printf("%s: %d failures\n", fail ? "FAIL" : "PASS", fail);
+  return fail ? 1 : 0;
+}
+
+/**
+ * @brief save the aggregates of the subtree in preorder
+ * @return number of doubles saved
+ */
+int save_aggregate(qtree_t *node, double *buf) {
+  int n = FIELD;
+
+  if (!node) {
+    return 0;
+  }
+  buf[0] = node->mass;
+  buf[1] = node->center.x;
+  buf[2] = node->center.y;
+  buf[3] = node->min_x;
+  buf[4] = node->min_y;
+  buf[5] = node->max_x;
+  buf[6] = node->max_y + node->dirty;
+  n += save_aggregate(node->ur, buf + n);
+  n += save_aggregate(node->ul, buf + n);
+  n += save_aggregate(node->ll, buf + n);
+  n += save_aggregate(node->lr, buf + n);
+  return n;
+}
+
+/**
+ * @brief the aggregates equal a full recompute bit for bit, since both
+ * sum the same terms in the same order
+ * @return 0 if fine or -1 if broken
+ */
+int check_aggregate(qtree_t *root, int node_count) {
+  double *kept, *full;
+  int n, ret = 0;
+
+  kept = malloc(sizeof(double) * FIELD * node_count);
+  full = malloc(sizeof(double) * FIELD * node_count);
+  if (!kept || !full) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    free(kept);
+    free(full);
+    return -1;
+  }
+  n = save_aggregate(root, kept);
+  qtree_aggregate(root);
+  if (save_aggregate(root, full) != n ||
+      memcmp(kept, full, sizeof(double) * n)) {
+    ret = -1;
+  }
+  free(kept);
+  free(full);
+  return ret;
+}
+
+/**
+ * @brief random position well inside the range of the leaf of the body
+ */
+void move_in_leaf(body_t *b, double *x, double *y) {
+  rectangle_t *r = b->leaf->range;
+
+  *x = r->vertex->x + r->dx * (0.01 + 0.98 * (rand() % 1000) / 1000.0);
+  *y = r->vertex->y + r->dy * (0.01 + 0.98 * (rand() % 1000) / 1000.0);
+}
+
+/**
+ * @return 0 if every body has its position and mass or -1 if not
+ */
+int check_same(int count, body_t *(*body)[BODYMAX], double *x, double *y,
+               double *mass) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if ((*body)[i]->pos->x != x[i] || (*body)[i]->pos->y != y[i] ||
+        (*body)[i]->mass != mass[i]) {
+      return -1;
+    }
+  }
+  return 0;
+}
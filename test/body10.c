@@ -6,38 +6,79 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include "qtree.h"
+#include "qtree_compact.h"
+#include "raster.h"
+#include "test_util.h"
 #include "threadpool.h"
 
 #define THREAD 4
 #define QUEUE 4096
 
-pthread_mutex_t mutex;
-pthread_cond_t cond;
-threadpool_t *threadpool;
-
-void read_data(char *fn, int *count, body_t *(*body)[BODYMAX]); 
+void show_window(qtree_t *root, int count, body_t *(*body)[BODYMAX]);
+void write_image(char *fn, qtree_t *root, threadpool_t *threadpool);
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Use: ./body10 filename\n");
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Use: ./body10 filename [image.ppm]\n");
     return 0;
   }
-  /* initial lock and threadpool */
-  pthread_mutex_init(&mutex, NULL);
-  pthread_cond_init(&cond, NULL);
-  threadpool = threadpool_create(THREAD, QUEUE);
+  /* initial threadpool and context */
+  threadpool_t *threadpool = threadpool_create(THREAD, QUEUE);
+  qtree_ctx_t *ctx = qtree_ctx_create(threadpool, 0);
 
   int count;
   body_t *body[BODYMAX];
   qtree_t *root;
+  qtree_compact_t *ct;
   int i;
 
-  read_data(argv[1], &count, &body);
+  if (read_data(argv[1], &count, &body)) {
+    return 1;
+  }
+  for (i = 0; i < count; i++) {
+    printf("%lf %lf %lf\n", body[i]->pos->x, body[i]->pos->y, body[i]->mass);
+  }
   /* create a qtree */
-  root = qtree_create(count, &body);
-  wait_qtree(count);
+  root = qtree_create(ctx, count, &body);
+  wait_qtree(ctx);
+  qtree_aggregate(root);
   /* traverse the qtree */
   qtree_traverse(root);
+  /* compact copy of the qtree */
+  ct = qtree_compact_create(root, 16);
+  if (ct) {
+    printf("compact: %u nodes, %zu bytes\n", ct->node_num,
+           qtree_compact_size(ct));
+    qtree_compact_traverse(ct);
+    qtree_compact_free(&ct);
+  }
+
+  if (argc == 3) {
+    /* render offscreen */
+    write_image(argv[2], root, threadpool);
+  } else {
+    show_window(root, count, &body);
+  }
+
+  /* destory the qtree */
+  qtree_destroy(&root);
+  printf("root: %p\n", root);
+  /* destroy context and thread pool */
+  qtree_ctx_free(&ctx);
+  threadpool_destroy(threadpool);
+  /* destroy body */
+  for (i = 0; i < count; i++) {
+    body_free(&body[i]);
+    printf("body: %p\n", body[i]);
+  } 
+  return 0;
+}
+
+/**
+ * @brief draw bodies and ranges on a X11 window until a key is pressed
+ */
+void show_window(qtree_t *root, int count, body_t *(*body)[BODYMAX]) {
+  int i;
 
   /* ====== x11 ======= */
   Display *dpy = XOpenDisplay(NULL);
@@ -72,7 +113,7 @@ int main(int argc, char *argv[]) {
       /* draw body */
       for (i = 0; i < count; i++) {
         point_t *p;
-        p = point_in_window(body[i]->pos, root->range->vertex, 
+        p = point_in_window((*body)[i]->pos, root->range->vertex, 
                             320.0/root->range->dx, 40);
         XDrawPoint(dpy, w, gc, p->x, p->y);
         point_free(&p);
@@ -98,42 +139,21 @@ int main(int argc, char *argv[]) {
   XDestroyWindow(dpy, w);
   XCloseDisplay(dpy);
   /* ====== x11 ======= */
-
-  /* destory the qtree */
-  qtree_destroy(&root);
-  printf("root: %p\n", root);
-  /* destroy thread pool */
-  threadpool_destroy(threadpool);
-  /* destroy body */
-  for (i = 0; i < count; i++) {
-    body_free(&body[i]);
-    printf("body: %p\n", body[i]);
-  } 
-  /* destroy lock */
-  pthread_mutex_destroy(&mutex);
-  pthread_cond_destroy(&cond);
-  return 0;
 }
 
 /**
- * @brief read body info from file into body array 
+ * @brief draw bodies and ranges into a PPM image without a display
  */
-void read_data(char *fn, int *count, body_t *(*body)[BODYMAX]) {
-  FILE *fd;
-  int i;
-  double x, y, mass;
+void write_image(char *fn, qtree_t *root, threadpool_t *threadpool) {
+  raster_t *r;
 
-  fd = fopen(fn, "r");
-  if (!fd) {
-    fprintf(stderr, "Error: fail to open file.\n");
-    exit(1);
-  }
-  fscanf(fd, "%d", count);
-  for (i = 0; i < *count; i++) {
-    fscanf(fd, "%lf%lf%lf", &x, &y, &mass);
-    (*body)[i] = body_create(x, y, mass);
-    printf("%lf %lf %lf\n", (*body)[i]->pos->x, (*body)[i]->pos->y, 
-                            (*body)[i]->mass);
+  r = raster_create(400, 400);
+  if (!r) {
+    fprintf(stderr, "Error: fail to create raster.\n");
+    return;
   }
-  fclose(fd);
+  raster_draw_qtree(r, root, root->range->vertex,
+                    320.0/root->range->dx, 40, threadpool, THREAD);
+  raster_write_ppm(r, fn);
+  raster_free(&r);
 }
@@ -0,0 +1,267 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "qtree.h"
+#include "qtree_compact.h"
+#include "test_util.h"
+#include "threadpool.h"
+
+#define THREAD 4
+#define QUEUE 4096
+
+int check_compact(qtree_compact_t *ct, uint32_t i, qtree_t *q,
+                  double x, double y, double dx, double dy);
+int count_qtree(qtree_t *q, rectangle_t *r);
+int count_compact(qtree_compact_t *ct, uint32_t i, rectangle_t *r,
+                  double x, double y, double dx, double dy);
+body_t **make_body(int count);
+
+/**
+ * @brief check compact qtrees against the qtree_t they come from, time
+ * range counting on both, then build a large compact qtree from bodies
+ */
+int main(int argc, char *argv[]) {
+  int round = (argc > 1) ? atoi(argv[1]) : 200;
+  int large = (argc > 2) ? atoi(argv[2]) : 1000000;
+  static body_t *body[BODYMAX];
+  body_t **many;
+  threadpool_t *threadpool;
+  qtree_ctx_t *ctx;
+  qtree_t *root;
+  qtree_compact_t *ct[3];
+  rectangle_t *range;
+  double start, t_qtree, t_compact;
+  long n_qtree = 0, n_compact = 0;
+  int i, k, r, fail = 0;
+
+  if (round < 1 || large < 0) {
+    fprintf(stderr, "Error: round >= 1 and large >= 0.\n");
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < BODYMAX; i++) {
+    /* some bodies share a position to reach QTREE_DEPTH_MAX */
+    if (i % 64 == 0) {
+      body[i] = body_create(123.25, 456.5, 1);
+    } else {
+      body[i] = body_create(rand() % 100000 / 10.0, rand() % 100000 / 10.0,
+                            1);
+    }
+  }
+  threadpool = threadpool_create(THREAD, QUEUE);
+  ctx = qtree_ctx_create(threadpool, 0);
+  root = qtree_create(ctx, BODYMAX, &body);
+  wait_qtree(ctx);
+
+  ct[0] = qtree_compact_create(root, 16);
+  ct[1] = qtree_compact_create(root, 32);
+  ct[2] = qtree_compact_build(BODYMAX, body, 16);
+  for (k = 0; k < 3; k++) {
+    if (!ct[k] || ct[k]->body_num != BODYMAX ||
+        check_compact(ct[k], 0, root, ct[k]->x, ct[k]->y,
+                      ct[k]->dx, ct[k]->dy)) {
+      fprintf(stderr, "Error: compact qtree %d does not match.\n", k);
+      fail++;
+    }
+  }
+  if (!fail) {
+    printf("qtree_t: %u nodes, %zu bytes; compact: %zu bytes (16 bits), "
+           "%zu bytes (32 bits)\n", ct[0]->node_num,
+           ct[0]->node_num * sizeof(qtree_t), qtree_compact_size(ct[0]),
+           qtree_compact_size(ct[1]));
+  }
+
+  /* range counting on both layouts */
+  range = rectangle_create(0, 0, 1, 1);
+  t_qtree = t_compact = 0;
+  for (r = 0; !fail && r < round; r++) {
+    range->vertex->x = rand() % 90000 / 10.0;
+    range->vertex->y = rand() % 90000 / 10.0;
+    range->dx = range->dy = 1000;
+    start = now();
+    n_qtree += count_qtree(root, range);
+    t_qtree += now() - start;
+    start = now();
+    n_compact += count_compact(ct[0], 0, range, ct[0]->x, ct[0]->y,
+                               ct[0]->dx, ct[0]->dy);
+    t_compact += now() - start;
+  }
+  if (n_qtree != n_compact) {
+    fprintf(stderr, "Error: range counts %ld and %ld.\n", n_qtree, n_compact);
+    fail++;
+  }
+  printf("range count: qtree_t %lf us, compact %lf us\n",
+         t_qtree / round * 1e6, t_compact / round * 1e6);
+  rectangle_free(&range);
+  for (k = 0; k < 3; k++) {
+    if (ct[k]) {
+      qtree_compact_free(&ct[k]);
+    }
+  }
+  qtree_destroy(&root);
+  qtree_ctx_free(&ctx);
+  threadpool_destroy(threadpool);
+  for (i = 0; i < BODYMAX; i++) {
+    body_free(&body[i]);
+  }
+
+  /* straight from bodies, beyond BODYMAX */
+  if (large > 0) {
+    many = make_body(large);
+    if (!many) {
+      return 1;
+    }
+    start = now();
+    ct[0] = qtree_compact_build(large, many, 16);
+    if (!ct[0] || ct[0]->body_num != (uint32_t) large ||
+        count_compact(ct[0], 0, &(rectangle_t) {&(point_t) {ct[0]->x, ct[0]->y},
+                      ct[0]->dx, ct[0]->dy}, ct[0]->x, ct[0]->y, ct[0]->dx,
+                      ct[0]->dy) != large) {
+      fprintf(stderr, "Error: large compact qtree is broken.\n");
+      fail++;
+    } else {
+      printf("%d bodies: built in %lf s, %u nodes, %zu bytes, "
+             "%lf bytes/body\n", large, now() - start, ct[0]->node_num,
+             qtree_compact_size(ct[0]),
+             (double) qtree_compact_size(ct[0]) / large);
+    }
+    if (ct[0]) {
+      qtree_compact_free(&ct[0]);
+    }
+    for (i = 0; i < large; i++) {
+      body_free(&many[i]);
+    }
+    free(many);
+  }
+  printf("%s: %d failures\n", fail ? "FAIL" : "PASS", fail);
+  return fail ? 1 : 0;
+}
+
+/**
+ * @brief derived ranges equal the ranges of the qtree_t, counts and
+ * leaves match, and quantized positions are within half a step
+ * @return 0 if fine or -1 if broken
+ */
+int check_compact(qtree_compact_t *ct, uint32_t i, qtree_t *q,
+                  double x, double y, double dx, double dy) {
+  qtree_cnode_t *n = &ct->node[i];
+  qtree_t *childs[4];
+  double step = 0.5 / ((ct->bits == 16) ? UINT16_MAX : UINT32_MAX);
+  double cx, cy, cdx, cdy;
+  point_t p;
+  uint32_t j;
+  int k;
+
+  if (x != q->range->vertex->x || y != q->range->vertex->y ||
+      dx != q->range->dx || dy != q->range->dy) {
+    fprintf(stderr, "Error: derived range differs.\n");
+    return -1;
+  }
+  if (n->count != (uint32_t) q->count || !n->child != !q->ur) {
+    fprintf(stderr, "Error: node differs.\n");
+    return -1;
+  }
+  if (!n->child) {
+    for (j = n->first; j < n->first + n->count; j++) {
+      qtree_compact_body_pos(ct, j, x, y, dx, dy, &p);
+      if (ct->body[j]->leaf != q ||
+          fabs(p.x - ct->body[j]->pos->x) > dx * step * (1 + 1e-6) ||
+          fabs(p.y - ct->body[j]->pos->y) > dy * step * (1 + 1e-6)) {
+        fprintf(stderr, "Error: body is off by more than half a step.\n");
+        return -1;
+      }
+    }
+    return 0;
+  }
+  childs[0] = q->ur;
+  childs[1] = q->ul;
+  childs[2] = q->ll;
+  childs[3] = q->lr;
+  for (k = 0; k < 4; k++) {
+    cx = x;
+    cy = y;
+    cdx = dx;
+    cdy = dy;
+    qtree_compact_child_range(k, &cx, &cy, &cdx, &cdy);
+    if (check_compact(ct, n->child + k, childs[k], cx, cy, cdx, cdy)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @return number of bodies of the qtree_t in the range
+ */
+int count_qtree(qtree_t *q, rectangle_t *r) {
+  rectangle_t *s = q->range;
+  int i, n = 0;
+
+  if (q->count == 0 || s->vertex->x + s->dx < r->vertex->x ||
+      r->vertex->x + r->dx < s->vertex->x ||
+      s->vertex->y + s->dy < r->vertex->y ||
+      r->vertex->y + r->dy < s->vertex->y) {
+    return 0;
+  }
+  if (!q->ur) {
+    for (i = 0; i < q->count; i++) {
+      n += is_point_in_rectangle_ur(q->body[i]->pos, r);
+    }
+    return n;
+  }
+  return count_qtree(q->ur, r) + count_qtree(q->ul, r) +
+         count_qtree(q->ll, r) + count_qtree(q->lr, r);
+}
+
+/**
+ * @return number of bodies of the compact qtree in the range, tested on
+ * exact positions so it matches count_qtree
+ */
+int count_compact(qtree_compact_t *ct, uint32_t i, rectangle_t *r,
+                  double x, double y, double dx, double dy) {
+  qtree_cnode_t *n = &ct->node[i];
+  double cx, cy, cdx, cdy;
+  uint32_t j;
+  int k, c = 0;
+
+  if (n->count == 0 || x + dx < r->vertex->x || r->vertex->x + r->dx < x ||
+      y + dy < r->vertex->y || r->vertex->y + r->dy < y) {
+    return 0;
+  }
+  if (!n->child) {
+    for (j = n->first; j < n->first + n->count; j++) {
+      c += is_point_in_rectangle_ur(ct->body[j]->pos, r);
+    }
+    return c;
+  }
+  for (k = 0; k < 4; k++) {
+    cx = x;
+    cy = y;
+    cdx = dx;
+    cdy = dy;
+    qtree_compact_child_range(k, &cx, &cy, &cdx, &cdy);
+    c += count_compact(ct, n->child + k, r, cx, cy, cdx, cdy);
+  }
+  return c;
+}
+
+/**
+ * @return array of count random bodies or NULL if fails
+ */
+body_t **make_body(int count) {
+  body_t **body;
+  int i;
+
+  body = malloc(sizeof(body_t *) * count);
+  if (!body) {
+    fprintf(stderr, "Error: fail to malloc.\n");
+    return NULL;
+  }
+  for (i = 0; i < count; i++) {
+    body[i] = body_create(rand() / (double) RAND_MAX * 1e6,
+                          rand() / (double) RAND_MAX * 1e6, 1);
+  }
+  return body;
+}
@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "qtree.h"
+#include "test_util.h"
+#include "threadpool.h"
+
+#define THREAD 4
+#define QUEUE 4096
+#define DATAMAX 64
+
+/**
+ * @brief build one tree per data file at once on a shared threadpool,
+ * repeat for some rounds and report trees per second
+ */
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Use: ./multitree round filename...\n");
+    return 0;
+  }
+  int round = atoi(argv[1]);
+  int data_num = argc - 2;
+  static body_t *body[DATAMAX][BODYMAX];
+  int count[DATAMAX];
+  qtree_ctx_t *ctx[DATAMAX];
+  qtree_t *root[DATAMAX];
+  threadpool_t *threadpool;
+  double start, elapsed;
+  long body_total = 0;
+  int i, j;
+
+  if (data_num > DATAMAX) {
+    fprintf(stderr, "Error: at most %d data files.\n", DATAMAX);
+    return 1;
+  }
+  for (i = 0; i < data_num; i++) {
+    if (read_data(argv[i + 2], &count[i], &body[i])) {
+      return 1;
+    }
+  }
+  threadpool = threadpool_create(THREAD, QUEUE);
+  for (i = 0; i < data_num; i++) {
+    ctx[i] = qtree_ctx_create(threadpool, 0);
+  }
+
+  start = now();
+  for (j = 0; j < round; j++) {
+    for (i = 0; i < data_num; i++) {
+      root[i] = qtree_create(ctx[i], count[i], &body[i]);
+    }
+    for (i = 0; i < data_num; i++) {
+      if (wait_qtree(ctx[i]) != count[i]) {
+        fprintf(stderr, "Error: tree of %s misses bodies.\n", argv[i + 2]);
+      }
+      body_total += count[i];
+    }
+    for (i = 0; i < data_num; i++) {
+      qtree_destroy(&root[i]);
+    }
+  }
+  elapsed = now() - start;
+  printf("%d trees, %ld bodies in %lf s: %lf trees/s, %lf bodies/s\n",
+         round * data_num, body_total, elapsed,
+         round * data_num / elapsed, body_total / elapsed);
+
+  for (i = 0; i < data_num; i++) {
+    qtree_ctx_free(&ctx[i]);
+  }
+  threadpool_destroy(threadpool);
+  for (i = 0; i < data_num; i++) {
+    for (j = 0; j < count[i]; j++) {
+      body_free(&body[i][j]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "qtree.h"
+#include "test_util.h"
+#include "threadpool.h"
+
+#define THREAD 4
+#define QUEUE 4096
+
+/**
+ * @brief latency from data arrival to the first query answer, blocking
+ * qtree_create and wait_qtree against qtree_create_async
+ */
+int main(int argc, char *argv[]) {
+  int round = (argc > 1) ? atoi(argv[1]) : 50;
+  int count = (argc > 2) ? atoi(argv[2]) : BODYMAX;
+  static body_t *body[BODYMAX];
+  static body_t *found[BODYMAX];
+  threadpool_t *threadpool;
+  qtree_ctx_t *ctx;
+  qtree_future_t *f;
+  qtree_t *root;
+  rectangle_t *range;
+  double start, first, whole;
+  double sync_first = 0, async_first = 0, async_whole = 0;
+  int r, i, n_sync, n_async, fail = 0;
+
+  if (count < 1 || count > BODYMAX) {
+    fprintf(stderr, "Error: count must be in [1, %d].\n", BODYMAX);
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < count; i++) {
+    body[i] = body_create(rand() % 100000 / 10.0, rand() % 100000 / 10.0, 1);
+  }
+  /* a small query around the first body */
+  range = rectangle_create(body[0]->pos->x - 50, body[0]->pos->y - 50,
+                           100, 100);
+  threadpool = threadpool_create(THREAD, QUEUE);
+  ctx = qtree_ctx_create(threadpool, 0);
+
+  for (r = 0; r < round; r++) {
+    /* blocking */
+    start = now();
+    root = qtree_create(ctx, count, &body);
+    wait_qtree(ctx);
+    n_sync = qtree_query_range(root, range, &found);
+    sync_first += now() - start;
+    qtree_destroy(&root);
+
+    /* pipelined */
+    start = now();
+    f = qtree_create_async(ctx, count, &body);
+    n_async = qtree_query_range(qtree_future_root(f), range, &found);
+    first = now() - start;
+    root = qtree_future_get(f);
+    whole = now() - start;
+    async_first += first;
+    async_whole += whole;
+    qtree_future_free(&f);
+    qtree_destroy(&root);
+
+    if (n_sync != n_async) {
+      fprintf(stderr, "Error: queries find %d and %d bodies.\n",
+              n_sync, n_async);
+      fail++;
+    }
+  }
+  printf("blocking: first answer %lf ms\n", sync_first / round * 1e3);
+  printf("async:    first answer %lf ms, whole qtree %lf ms\n",
+         async_first / round * 1e3, async_whole / round * 1e3);
+
+  qtree_ctx_free(&ctx);
+  threadpool_destroy(threadpool);
+  rectangle_free(&range);
+  for (i = 0; i < count; i++) {
+    body_free(&body[i]);
+  }
+  return fail ? 1 : 0;
+}
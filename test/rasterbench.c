@@ -0,0 +1,193 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "qtree.h"
+#include "raster.h"
+#include "test_util.h"
+#include "threadpool.h"
+
+#define THREAD 4
+#define QUEUE 4096
+
+typedef struct nested_t nested_t;
+struct nested_t {
+  qtree_t *root;
+  int count;
+  threadpool_t *threadpool;
+  int ret; /* -1 until the frame is drawn */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+int check_raster(raster_t *r, int count);
+int check_nested(qtree_t *root, int count);
+void *draw_nested(void *arg);
+
+static const int size[] = {256, 1024, 4096};
+
+/**
+ * @brief time raster_draw_qtree at several sizes with and without the
+ * threadpool, and check the output: every body is counted once in the
+ * density and the tiled image does not depend on the number of tasks;
+ * then draw from a task of a saturated threadpool
+ */
+int main(int argc, char *argv[]) {
+  int round = (argc > 1) ? atoi(argv[1]) : 10;
+  int count = (argc > 2) ? atoi(argv[2]) : BODYMAX;
+  int size_num = (int) (sizeof(size) / sizeof(size[0]));
+  static body_t *body[BODYMAX];
+  threadpool_t *threadpool;
+  qtree_ctx_t *ctx;
+  qtree_t *root;
+  raster_t *one, *many;
+  double start, t_one, t_many, ratio;
+  int s, r, i, fail = 0;
+
+  if (round < 1 || count < 1 || count > BODYMAX) {
+    fprintf(stderr, "Error: round >= 1 and count in [1, %d].\n", BODYMAX);
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < count; i++) {
+    body[i] = body_create(rand() % 100000 / 10.0, rand() % 100000 / 10.0, 1);
+  }
+  threadpool = threadpool_create(THREAD, QUEUE);
+  ctx = qtree_ctx_create(threadpool, 0);
+  root = qtree_create(ctx, count, &body);
+  wait_qtree(ctx);
+
+  for (s = 0; s < size_num; s++) {
+    one = raster_create(size[s], size[s]);
+    many = raster_create(size[s], size[s]);
+    if (!one || !many) {
+      return 1;
+    }
+    /* the whole root range with a margin of 8 pixels */
+    ratio = (size[s] - 16.0) / root->range->dx;
+    t_one = t_many = 0;
+    for (r = 0; r < round; r++) {
+      raster_clear(one);
+      start = now();
+      raster_draw_qtree(one, root, root->range->vertex, ratio, 8, NULL, 0);
+      t_one += now() - start;
+      raster_clear(many);
+      start = now();
+      raster_draw_qtree(many, root, root->range->vertex, ratio, 8,
+                        threadpool, THREAD);
+      t_many += now() - start;
+    }
+    if (check_raster(one, count) || check_raster(many, count) ||
+        memcmp(one->pixel, many->pixel, 3 * (size_t) size[s] * size[s])) {
+      fprintf(stderr, "Error: bad raster at %dx%d.\n", size[s], size[s]);
+      fail++;
+    }
+    printf("%4dx%-4d %d bodies: %lf ms/frame inline, %lf ms/frame %d tasks\n",
+           size[s], size[s], count, t_one / round * 1e3,
+           t_many / round * 1e3, THREAD);
+    raster_free(&one);
+    raster_free(&many);
+  }
+  if (check_nested(root, count)) {
+    fprintf(stderr, "Error: frame drawn from a threadpool task hangs.\n");
+    fail++;
+  }
+
+  qtree_destroy(&root);
+  qtree_ctx_free(&ctx);
+  threadpool_destroy(threadpool);
+  for (i = 0; i < count; i++) {
+    body_free(&body[i]);
+  }
+  printf("%s: %d failures\n", fail ? "FAIL" : "PASS", fail);
+  return fail ? 1 : 0;
+}
+
+/**
+ * @brief density adds up to the number of bodies, a pixel is bright iff
+ * it holds bodies, and the root outline is drawn
+ * @return 0 if fine or -1 if broken
+ */
+int check_raster(raster_t *r, int count) {
+  long total = 0;
+  int i, lit;
+
+  for (i = 0; i < r->width * r->height; i++) {
+    total += r->density[i];
+    lit = r->pixel[3 * i] > 0x60;
+    if (lit != (r->density[i] > 0)) {
+      fprintf(stderr, "Error: pixel %d does not match its density.\n", i);
+      return -1;
+    }
+  }
+  if (total != count) {
+    fprintf(stderr, "Error: density holds %ld of %d bodies.\n", total, count);
+    return -1;
+  }
+  if (r->pixel[3 * (8 * r->width + 8)] == 0) {
+    fprintf(stderr, "Error: root range is not drawn.\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief draw a frame from the only thread of a threadpool, which is
+ * busy with the caller, while posting tasks to that threadpool
+ * @return 0 if the frame is drawn and checked or -1 if not within 10 s
+ */
+int check_nested(qtree_t *root, int count) {
+  threadpool_t *threadpool;
+  nested_t n;
+  struct timespec deadline;
+  int ret;
+
+  n.root = root;
+  n.count = count;
+  n.ret = -1;
+  pthread_mutex_init(&n.lock, NULL);
+  pthread_cond_init(&n.cond, NULL);
+  threadpool = threadpool_create(1, QUEUE);
+  n.threadpool = threadpool;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 10;
+  pthread_mutex_lock(&n.lock);
+  if (threadpool_add(threadpool, draw_nested, (void *) &n)) {
+    pthread_mutex_unlock(&n.lock);
+    return -1;
+  }
+  while (n.ret == -1 &&
+         pthread_cond_timedwait(&n.cond, &n.lock, &deadline) == 0) {
+  }
+  ret = n.ret;
+  pthread_mutex_unlock(&n.lock);
+  if (ret != -1) {
+    /* late tasks of the frame run here, after its raster is freed */
+    threadpool_destroy(threadpool);
+    pthread_cond_destroy(&n.cond);
+    pthread_mutex_destroy(&n.lock);
+  }
+  return (ret == 0) ? 0 : -1;
+}
+
+void *draw_nested(void *arg) {
+  nested_t *n = (nested_t *) arg;
+  raster_t *r;
+  int ret;
+
+  r = raster_create(256, 256);
+  if (!r) {
+    return NULL;
+  }
+  raster_draw_qtree(r, n->root, n->root->range->vertex,
+                    240.0 / n->root->range->dx, 8, n->threadpool, THREAD);
+  ret = check_raster(r, n->count);
+  raster_free(&r);
+  pthread_mutex_lock(&n->lock);
+  n->ret = ret ? 1 : 0;
+  pthread_cond_signal(&n->cond);
+  pthread_mutex_unlock(&n->lock);
+  return NULL;
+}
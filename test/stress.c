@@ -0,0 +1,408 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qtree.h"
+#include "test_util.h"
+#include "threadpool.h"
+
+#define QUEUE 16 /* small on purpose, so threadpool_add fails sometimes */
+#define WATCHDOG 60 /* seconds a build may take before stress gives up */
+
+typedef void (*input_t)(int count, body_t *(*body)[BODYMAX]);
+
+void input_uniform(int count, body_t *(*body)[BODYMAX]);
+void input_cluster(int count, body_t *(*body)[BODYMAX]);
+void input_line(int count, body_t *(*body)[BODYMAX]);
+void input_same(int count, body_t *(*body)[BODYMAX]);
+void input_grid(int count, body_t *(*body)[BODYMAX]);
+void input_far(int count, body_t *(*body)[BODYMAX]);
+int check_qtree(qtree_t *node, int *leaf_body);
+int check_body(int count, body_t *(*body)[BODYMAX]);
+int check_async(qtree_t *root, int count, body_t *(*body)[BODYMAX]);
+int compare_body(const void *a, const void *b);
+void watchdog(int sig);
+
+/* what is built now, reported by watchdog */
+static char building[128];
+
+static const struct {
+  const char *name;
+  input_t make;
+} input[] = {
+  {"uniform", input_uniform},
+  {"cluster", input_cluster},
+  {"line", input_line},
+  {"same", input_same},
+  {"grid", input_grid},
+  {"far", input_far},
+};
+static const int thread[] = {1, 2, 4, 8};
+static const int task_max[] = {1, QTREE_TASK_MAX};
+static const int input_num = sizeof(input) / sizeof(input[0]);
+static const int thread_num = sizeof(thread) / sizeof(thread[0]);
+static const int task_max_num = sizeof(task_max) / sizeof(task_max[0]);
+
+/**
+ * @brief build qtrees again and again from random and adversarial inputs
+ * at several thread counts, check invariants and report throughput
+ *
+ * With async set, qtrees are created by qtree_create_async and queried
+ * with qtree_query_range and qtree_wait_node while they are built; the
+ * time then includes the queries. Build it with stress-asan or
+ * stress-tsan to catch memory errors and races on the construction path.
+ */
+int main(int argc, char *argv[]) {
+  int round = (argc > 1) ? atoi(argv[1]) : 20;
+  int count = (argc > 2) ? atoi(argv[2]) : 1000;
+  int async = (argc > 3) ? atoi(argv[3]) : 0;
+  static body_t *body[BODYMAX];
+  threadpool_t *threadpool;
+  qtree_ctx_t *ctx, *ctx_once;
+  qtree_future_t *f;
+  qtree_t *root;
+  double start, elapsed;
+  int in, th, tm, r, i, n, leaf_body, fail = 0;
+
+  if (count < 0 || count > BODYMAX) {
+    fprintf(stderr, "Error: count must be in [0, %d].\n", BODYMAX);
+    return 1;
+  }
+  if (round <= 3) {
+    fprintf(stderr, "Error: round must be more than 3.\n");
+    return 1;
+  }
+  signal(SIGALRM, watchdog);
+  srand(1);
+  for (th = 0; th < thread_num; th++) {
+    threadpool = threadpool_create(thread[th], QUEUE);
+    for (tm = 0; tm < task_max_num; tm++) {
+      ctx = qtree_ctx_create(threadpool, task_max[tm]);
+      for (in = 0; in < input_num; in++) {
+        elapsed = 0;
+        for (r = 0; r < round; r++) {
+          /* sizes 0, 1, 2 and count come up in turn */
+          n = (r < 3) ? r : count;
+          input[in].make(n, &body);
+          snprintf(building, sizeof(building), "Error: %s: build hangs, "
+                   "thread %d, task_max %d, round %d.\n", input[in].name,
+                   thread[th], task_max[tm], r);
+          alarm(WATCHDOG);
+          if (async) {
+            /* free the context right after qtree_future_get, as
+             * pipeline does, so late constructions touch freed memory */
+            ctx_once = qtree_ctx_create(threadpool, task_max[tm]);
+            f = ctx_once ? qtree_create_async(ctx_once, n, &body) : NULL;
+            root = f ? qtree_future_get(f) : NULL;
+            if (f) {
+              qtree_future_free(&f);
+            }
+            if (root) {
+              qtree_destroy(&root);
+            }
+            if (ctx_once) {
+              qtree_ctx_free(&ctx_once);
+            }
+          }
+          start = now();
+          if (async) {
+            f = qtree_create_async(ctx, n, &body);
+            root = f ? qtree_future_root(f) : NULL;
+            if (root && check_async(root, n, &body)) {
+              fprintf(stderr, "Error: %s: query while building differs, "
+                      "thread %d, round %d.\n", input[in].name, thread[th], r);
+              fail++;
+            }
+            if (f) {
+              qtree_future_free(&f);
+            }
+          } else {
+            root = qtree_create(ctx, n, &body);
+          }
+          if (!root) {
+            fprintf(stderr, "Error: fail to create qtree.\n");
+            return 1;
+          }
+          if (wait_qtree(ctx) != n) {
+            fprintf(stderr, "Error: %s: leaves hold %d of %d bodies.\n",
+                    input[in].name, ctx->leaf_count, n);
+            fail++;
+          }
+          elapsed += now() - start;
+          alarm(0);
+          leaf_body = 0;
+          if (check_qtree(root, &leaf_body) || leaf_body != n ||
+              check_body(n, &body)) {
+            fprintf(stderr, "Error: %s: broken qtree, thread %d, round %d.\n",
+                    input[in].name, thread[th], r);
+            fail++;
+          }
+          qtree_destroy(&root);
+          for (i = 0; i < n; i++) {
+            body_free(&body[i]);
+          }
+        }
+        printf("%-8s thread=%d task_max=%-3d %lf trees/s %lf bodies/s\n",
+               input[in].name, thread[th], task_max[tm], round / elapsed,
+               ((double) (round - 3) * count + 3) / elapsed);
+      }
+      if (ctx->node_count != 0 || ctx->leaf_count != 0) {
+        fprintf(stderr, "Error: context keeps %d nodes, %d bodies.\n",
+                ctx->node_count, ctx->leaf_count);
+        fail++;
+      }
+      qtree_ctx_free(&ctx);
+    }
+    threadpool_destroy(threadpool);
+  }
+  printf("%s: %d failures\n", fail ? "FAIL" : "PASS", fail);
+  return fail ? 1 : 0;
+}
+
+void input_uniform(int count, body_t *(*body)[BODYMAX]) {
+  int i;
+  for (i = 0; i < count; i++) {
+    (*body)[i] = body_create(rand() % 100000 / 10.0, rand() % 100000 / 10.0,
+                             1);
+  }
+}
+
+/**
+ * @brief most bodies within a tiny range around one point
+ */
+void input_cluster(int count, body_t *(*body)[BODYMAX]) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if (i % 10 == 0) {
+      (*body)[i] = body_create(rand() % 1000, rand() % 1000, 1);
+    } else {
+      (*body)[i] = body_create(500 + (rand() % 1000) * 1e-9,
+                               500 + (rand() % 1000) * 1e-9, 1);
+    }
+  }
+}
+
+void input_line(int count, body_t *(*body)[BODYMAX]) {
+  int i;
+  for (i = 0; i < count; i++) {
+    (*body)[i] = body_create(i * 0.5, i * 0.5, 1);
+  }
+}
+
+/**
+ * @brief bodies at the same position can never be split apart
+ */
+void input_same(int count, body_t *(*body)[BODYMAX]) {
+  int i;
+  for (i = 0; i < count; i++) {
+    (*body)[i] = body_create((i % 3) ? 7 : -7, 7, 1);
+  }
+}
+
+/**
+ * @brief integer grid, bodies fall on the edges between ranges
+ */
+void input_grid(int count, body_t *(*body)[BODYMAX]) {
+  int i;
+  for (i = 0; i < count; i++) {
+    (*body)[i] = body_create(i % 32, i / 32, 1);
+  }
+}
+
+/**
+ * @brief negative and huge coordinates
+ */
+void input_far(int count, body_t *(*body)[BODYMAX]) {
+  int i;
+  for (i = 0; i < count; i++) {
+    (*body)[i] = body_create(-1e15 + rand() % 1000 * 1e12,
+                             -(rand() % 1000) - 1e-3, 1);
+  }
+}
+
+/**
+ * @brief check counts, parent links, childs tile the parent range, bodies
+ * of a child lie on its side of the parent's center and bodies of a leaf
+ * point back to it
+ *
+ * Sides are half-open as in qtree_create: a body on the center goes to
+ * ur. The outer edges of a child may be rounded, so they are not used.
+ * @return 0 if fine or -1 if broken
+ */
+int check_qtree(qtree_t *node, int *leaf_body) {
+  qtree_t *childs[4];
+  rectangle_t *r = node->range;
+  double dx = r->dx / 2, dy = r->dy / 2;
+  double cx = r->vertex->x + dx, cy = r->vertex->y + dy;
+  point_t *p;
+  int i, j, right, upper, sum = 0;
+
+  if (!node->parent) {
+    for (i = 0; i < node->count; i++) {
+      if (!is_point_in_rectangle_ur(node->body[i]->pos, r)) {
+        fprintf(stderr, "Error: body is not in the root.\n");
+        return -1;
+      }
+    }
+  }
+  if (!node->ur) {
+    if (node->count > 1 && node->depth < QTREE_DEPTH_MAX) {
+      fprintf(stderr, "Error: leaf holds %d bodies.\n", node->count);
+      return -1;
+    }
+    for (i = 0; i < node->count; i++) {
+      if (node->body[i]->leaf != node) {
+        fprintf(stderr, "Error: body is not in its leaf.\n");
+        return -1;
+      }
+    }
+    *leaf_body += node->count;
+    return 0;
+  }
+  childs[0] = node->ur;
+  childs[1] = node->ul;
+  childs[2] = node->ll;
+  childs[3] = node->lr;
+  if (node->ur->range->vertex->x != r->vertex->x + dx ||
+      node->ur->range->vertex->y != r->vertex->y + dy ||
+      node->ul->range->vertex->x != r->vertex->x ||
+      node->ul->range->vertex->y != r->vertex->y + dy ||
+      node->ll->range->vertex->x != r->vertex->x ||
+      node->ll->range->vertex->y != r->vertex->y ||
+      node->lr->range->vertex->x != r->vertex->x + dx ||
+      node->lr->range->vertex->y != r->vertex->y) {
+    fprintf(stderr, "Error: childs do not tile the parent.\n");
+    return -1;
+  }
+  for (i = 0; i < 4; i++) {
+    if (!childs[i] || childs[i]->parent != node ||
+        childs[i]->depth != node->depth + 1 ||
+        childs[i]->range->dx != dx || childs[i]->range->dy != dy) {
+      fprintf(stderr, "Error: bad child.\n");
+      return -1;
+    }
+    for (j = 0; j < childs[i]->count; j++) {
+      p = childs[i]->body[j]->pos;
+      right = (cx <= p->x);
+      upper = (cy <= p->y);
+      if (right != (i == 0 || i == 3) || upper != (i == 0 || i == 1)) {
+        fprintf(stderr, "Error: body is on the wrong side of the center.\n");
+        return -1;
+      }
+    }
+    sum += childs[i]->count;
+    if (check_qtree(childs[i], leaf_body)) {
+      return -1;
+    }
+  }
+  if (sum != node->count) {
+    fprintf(stderr, "Error: childs hold %d of %d bodies.\n", sum,
+            node->count);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief report the build which hangs, e.g. on a lost construction which
+ * leaves wait_qtree blocked, and exit
+ */
+void watchdog(int sig) {
+  ssize_t ret;
+
+  (void) sig;
+  ret = write(STDERR_FILENO, building, strlen(building));
+  (void) ret;
+  _exit(1);
+}
+
+/**
+ * @brief every body is linked to a leaf
+ * @return 0 if fine or -1 if broken
+ */
+int check_body(int count, body_t *(*body)[BODYMAX]) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if (!(*body)[i]->leaf) {
+      fprintf(stderr, "Error: body %d is in no leaf.\n", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief query random ranges and walk random paths down to a leaf while
+ * the qtree may still be built, and check against a scan of all bodies
+ * @return 0 if fine or -1 if broken
+ */
+int check_async(qtree_t *root, int count, body_t *(*body)[BODYMAX]) {
+  static body_t *found[BODYMAX];
+  qtree_t *childs[4];
+  rectangle_t *r = root->range;
+  rectangle_t range;
+  point_t vertex;
+  qtree_t *node;
+  int q, i, n, expect;
+
+  range.vertex = &vertex;
+  for (q = 0; q < 8; q++) {
+    /* around a body, from a tiny range up to the whole root */
+    range.dx = r->dx * (rand() % 101) / 100;
+    range.dy = r->dy * (rand() % 101) / 100;
+    if (count > 0) {
+      i = rand() % count;
+      vertex.x = (*body)[i]->pos->x - range.dx / 2;
+      vertex.y = (*body)[i]->pos->y - range.dy / 2;
+    } else {
+      vertex.x = r->vertex->x;
+      vertex.y = r->vertex->y;
+    }
+    n = qtree_query_range(root, &range, &found);
+    expect = 0;
+    for (i = 0; i < count; i++) {
+      expect += is_point_in_rectangle_ur((*body)[i]->pos, &range);
+    }
+    qsort(found, n, sizeof(found[0]), compare_body);
+    for (i = 0; i < n; i++) {
+      if (!is_point_in_rectangle_ur(found[i]->pos, &range) ||
+          (i > 0 && found[i] == found[i - 1])) {
+        fprintf(stderr, "Error: query finds a wrong body.\n");
+        return -1;
+      }
+    }
+    if (n != expect) {
+      fprintf(stderr, "Error: query finds %d of %d bodies.\n", n, expect);
+      return -1;
+    }
+
+    /* childs of a node are final once qtree_wait_node returns */
+    node = root;
+    qtree_wait_node(node);
+    while (node->ur) {
+      childs[0] = node->ur;
+      childs[1] = node->ul;
+      childs[2] = node->ll;
+      childs[3] = node->lr;
+      node = childs[rand() % 4];
+      qtree_wait_node(node);
+    }
+    for (i = 0; i < node->count; i++) {
+      if (node->body[i]->leaf != node) {
+        fprintf(stderr, "Error: waited leaf is not linked.\n");
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int compare_body(const void *a, const void *b) {
+  const body_t *x = *(body_t * const *) a;
+  const body_t *y = *(body_t * const *) b;
+
+  return (x < y) ? -1 : (x > y);
+}
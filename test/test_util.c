@@ -0,0 +1,45 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <time.h>
+#include "qtree.h"
+#include "test_util.h"
+
+/**
+ * @brief read body info from file into body array
+ * @return 0 if success or -1 if fail
+ */
+int read_data(char *fn, int *count, body_t *(*body)[BODYMAX]) {
+  FILE *fd;
+  int i;
+  double x, y, mass;
+
+  fd = fopen(fn, "r");
+  if (!fd) {
+    fprintf(stderr, "Error: fail to open file.\n");
+    return -1;
+  }
+  if (fscanf(fd, "%d", count) != 1 || *count < 0 || *count > BODYMAX) {
+    fprintf(stderr, "Error: %s must hold at most %d bodies.\n", fn, BODYMAX);
+    fclose(fd);
+    return -1;
+  }
+  for (i = 0; i < *count; i++) {
+    if (fscanf(fd, "%lf%lf%lf", &x, &y, &mass) != 3) {
+      fprintf(stderr, "Error: fail to read body.\n");
+      *count = i;
+      break;
+    }
+    (*body)[i] = body_create(x, y, mass);
+  }
+  fclose(fd);
+  return 0;
+}
+
+/**
+ * @return monotonic time in seconds
+ */
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
@@ -0,0 +1,8 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include "qtree.h"
+
+int read_data(char *fn, int *count, body_t *(*body)[BODYMAX]);
+double now(void);
+#endif